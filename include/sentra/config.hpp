@@ -13,13 +13,44 @@ struct AppConfig {
   std::string m_systemPrompt{"You are Sentra, a local-first terminal AI assistant."};
   std::string m_localCommandTemplate{""};
   std::size_t m_maxTokens{256};
+  // Wall-clock budget per turn in ms; 0 = none.
+  std::size_t m_maxLatencyMs{0};
   std::size_t m_contextWindowTokens{2048};
+  // Empty = the prompt format's turn markers, "none" = no stop sequences.
+  std::string m_stopSequences;
+  std::size_t m_repeatWindow{128};
+  std::size_t m_repeatThreshold{2};
+  std::size_t m_repeatMinTokens{64};
+  std::string m_contextPrunePolicy{"sliding"};
+  double m_contextLowWater{0.6};
   int m_llamaNThreads{0};
   int m_llamaNThreadsBatch{0};
-  int m_llamaNBatch{512};
+  int m_llamaNBatch{0};
+  int m_llamaNUbatch{0};
+  int m_llamaParallel{1};
+  int m_llamaPrefixCacheEntries{4};
+  int m_llamaPrefixCacheMb{256};
+  std::string m_promptCacheDir{".sentra/prompt-cache"};
+  std::string m_tuneDir{".sentra/tune"};
+  std::string m_llamaCpuSet;
+  int m_llamaNumaNode{-1};
+  std::string m_llamaNuma;
+  bool m_keepPreviousModel{false};
+  std::string m_llamaKvType;
+  std::string m_llamaFlashAttn;
+  int m_llamaResidentMb{0};
   bool m_llamaOffloadKqv{false};
   bool m_llamaOpOffload{false};
+  std::string m_draftModelId{""};
+  int m_llamaDraftMax{8};
+  float m_llamaDraftPMin{0.75f};
+  bool m_llamaNgramDraft{false};
+  int m_llamaNgramMin{2};
+  int m_llamaNgramMax{4};
   std::string m_profile{"balanced"};
+  static constexpr std::size_t kFastProfileLatencyMs = 10000;
+  std::string m_sessionKvSnapshot{"exit"};
+  std::string m_daemonSocket{".sentra/sentra.sock"};
 
   static AppConfig load_from_file(const std::string& path);
 };
@@ -12,9 +12,24 @@ struct ContextPruneResult {
   std::vector<Message> m_messages;
   bool m_truncated{false};
   std::size_t m_tokensKept{0};
+  std::size_t m_firstKeptIndex{0};
 };
 
 std::size_t estimate_tokens(const std::string& text);
 ContextPruneResult prune_context_window(const std::vector<Message>& history, std::size_t tokenBudget);
+// Hysteresis policy: keeps every message from firstKeptIndex on while the
+// result fits tokenBudget. Once over budget, the cut advances in one step
+// until the kept history fits lowWaterTokens, so the prompt start (and the
+// KV cache built on it) stays fixed for the turns that follow. System
+// messages are always kept; feed m_firstKeptIndex back in on the next turn.
+ContextPruneResult prune_context_window_stable(const std::vector<Message>& history, std::size_t tokenBudget,
+                                               std::size_t lowWaterTokens, std::size_t firstKeptIndex);
+// Second pass for runtimes that know the real size of each message
+// (messageTokens[i] for messages[i]); estimate_tokens() counts words, and code
+// can take three or more tokens per word. Drops the oldest non-system
+// messages until the total fits tokenBudget; system messages and the last
+// message are always kept, so the result may still be over budget.
+ContextPruneResult prune_to_token_counts(const std::vector<Message>& messages,
+                                         const std::vector<std::size_t>& messageTokens, std::size_t tokenBudget);
 
 }  // namespace sentra
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "sentra/orchestrator.hpp"
+#include "sentra/session_store.hpp"
+
+namespace sentra {
+
+// Line protocol spoken over the daemon socket. Every frame is one line of
+// tab-separated fields; fields are escaped so tokens may contain newlines.
+//   client -> daemon: ping | status | shutdown | prompt<TAB>session<TAB>text
+//   daemon -> client: session | token | warn | perf | info | error | done
+std::string encode_frame(const std::vector<std::string>& fields);
+std::vector<std::string> decode_frame(const std::string& line);
+
+// Client-supplied session ids name files in the session directory, so only
+// [A-Za-z0-9_-]+ is accepted.
+bool is_valid_session_id(const std::string& sessionId);
+
+// Owns the orchestrator (and therefore the loaded models) for the lifetime of
+// the process and serves clients over a Unix domain socket, one thread per
+// connection. Turns from different clients run concurrently (see
+// llama_parallel); sessions are loaded from and appended to the session store
+// exactly as the REPL does.
+class Daemon {
+ public:
+  Daemon(std::string socketPath, SessionStore&& sessionStore, Orchestrator&& orchestrator,
+         std::string systemPrompt);
+
+  int run();
+
+ private:
+  std::string m_socketPath;
+  SessionStore m_sessionStore;
+  Orchestrator m_orchestrator;
+  std::string m_systemPrompt;
+  std::mutex m_mutex;
+  // One per session id, guarded by m_mutex: turns of the same session run one
+  // at a time so history loads and log appends never interleave.
+  std::map<std::string, std::shared_ptr<std::mutex>> m_sessionMutexes;
+  std::atomic<bool> m_stopRequested{false};
+  int m_listenFd{-1};
+  std::mutex m_clientsMutex;
+  std::condition_variable m_clientsIdle;
+  std::set<int> m_clientFds;
+
+  void serve_client(int fd);
+  void handle_prompt(int fd, std::string sessionId, const std::string& text);
+  void handle_status(int fd);
+};
+
+// Client side of the protocol. With a non-empty prompt a single turn is sent;
+// otherwise each stdin line is sent as a prompt in the same session.
+int run_daemon_client(const std::string& socketPath, std::string sessionId, const std::string& prompt);
+int stop_daemon(const std::string& socketPath);
+
+}  // namespace sentra
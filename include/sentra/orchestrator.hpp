@@ -1,9 +1,12 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "sentra/app_state.hpp"
@@ -31,20 +34,81 @@ class Orchestrator {
   std::size_t max_tokens() const;
   std::size_t context_window_tokens() const;
   void set_max_tokens(std::size_t value);
+  std::size_t max_latency_ms() const;
+  void set_max_latency_ms(std::size_t value);
   void set_context_window_tokens(std::size_t value);
+  std::string context_prune_policy() const;
+  bool set_context_prune_policy(const std::string& policy, std::string& error);
+  double context_low_water() const;
+  void set_context_low_water(double ratio);
+  std::size_t prefix_stable_turns() const;
+  std::string speculative_mode() const;
+  PerfTotals perf_totals() const;
   std::string profile() const;
   bool set_profile(const std::string& profile, std::string& error);
-  GenerationResult respond(const std::vector<Message>& history, StreamCallback on_token);
+  void preload_active_model();
+  // Runs the runtime's thread/batch sweep for the active model; returns the
+  // path of the persisted settings.
+  std::string tune_active_model(StreamCallback on_progress);
+  std::string model_load_status() const;
+  std::string memory_plan() const;
+  // Ids of models the runtime keeps loaded besides the active one.
+  std::vector<std::string> resident_model_ids() const;
+  void set_session_state_path(std::string path);
+  void save_session_state();
+  // Setting *cancel (e.g. from a SIGINT handler) stops the turn within one
+  // token; the partial answer is returned with m_cancelled set.
+  GenerationResult respond(const std::vector<Message>& history, StreamCallback on_token,
+                           PrefillProgressCallback on_prefill = nullptr, const std::atomic<bool>* cancel = nullptr);
+  // Same as respond() for an explicit session; safe to call from several
+  // threads at once (the daemon serves one session per client).
+  GenerationResult respond_in_session(const std::string& sessionStatePath, const std::vector<Message>& history,
+                                      StreamCallback on_token, PrefillProgressCallback on_prefill = nullptr,
+                                      const std::atomic<bool>* cancel = nullptr);
+  // Keeps decoding the last message of history, which must be an assistant
+  // answer (e.g. one cut off at max_tokens). The result holds only the new
+  // text and tokens; merge them with extend_message().
+  GenerationResult continue_answer(const std::vector<Message>& history, StreamCallback on_token,
+                                   PrefillProgressCallback on_prefill = nullptr,
+                                   const std::atomic<bool>* cancel = nullptr);
+  // Answers the last user message again, dropping the assistant answer that
+  // ends history; the prompt KV is reused up to the end of that message.
+  // samples > 1 asks for extra answers in m_alternatives; only the first is
+  // streamed.
+  GenerationResult retry_answer(const std::vector<Message>& history, std::size_t samples, StreamCallback on_token,
+                                PrefillProgressCallback on_prefill = nullptr,
+                                const std::atomic<bool>* cancel = nullptr);
 
  private:
+  // retrySamples > 0 marks a /retry turn asking for that many answers.
+  GenerationResult run_turn(const std::string& sessionStatePath, const std::vector<Message>& history,
+                            StreamCallback on_token, PrefillProgressCallback on_prefill,
+                            const std::atomic<bool>* cancel, bool continueLast, std::size_t retrySamples = 0);
+
   AppConfig m_config;
   ModelRegistry m_modelRegistry;
   AppState m_appState;
   std::vector<std::unique_ptr<IModelRuntime>> m_runtimes;
   std::string m_runtimeSelectionNote;
+  // Hysteresis cut and prefix-stability streak of one session's history.
+  struct PruneState {
+    std::size_t m_pruneCut{0};
+    std::size_t m_prunedMessages{0};
+    std::size_t m_prefixStableTurns{0};
+  };
+
+  std::string m_sessionStatePath;
+  // Guards the per-turn bookkeeping below; held in a pointer so the
+  // orchestrator stays movable.
+  std::unique_ptr<std::mutex> m_turnMutex{std::make_unique<std::mutex>()};
+  std::unordered_map<std::string, PruneState> m_pruneStates;
+  PerfTotals m_perfTotals;
+  // Model that answered the last turn; serves while a new selection loads.
+  std::string m_servingModelId;
   std::optional<std::size_t> m_activeRuntimeIndex;
 
   std::optional<std::size_t> pick_runtime_index(std::string& note) const;
+  void apply_context_tokens();
 };
 
 }  // namespace sentra
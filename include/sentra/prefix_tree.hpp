@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace sentra {
+
+// Radix tree over token sequences. Each entry is a full token path from the
+// root tagged with a caller-chosen id (llama-inproc uses a KV sequence id), so
+// entries that share a prefix share the tree nodes for it. token_count() is
+// the number of distinct tokens stored, which is what the shared KV cells
+// behind the entries cost.
+class PrefixTree {
+ public:
+  struct Match {
+    int m_entry{-1};
+    std::size_t m_length{0};
+  };
+
+  PrefixTree();
+
+  // Longest prefix of tokens covered by some entry, and the most recently
+  // used entry whose path starts with it. Marks that entry as used.
+  Match longest_match(const std::vector<std::int32_t>& tokens);
+  // Adds an entry for exactly these tokens; an existing entry with the same
+  // path is replaced (its id is returned so the caller can release it).
+  int insert(const std::vector<std::int32_t>& tokens, int entry);
+  void erase(int entry);
+  void clear();
+
+  int least_recent_entry() const;
+  std::size_t entry_count() const;
+  std::size_t token_count() const;
+
+ private:
+  struct Node {
+    std::vector<std::int32_t> m_edge;
+    std::map<std::int32_t, std::unique_ptr<Node>> m_children;
+    Node* m_parent{nullptr};
+    int m_entry{-1};
+    std::uint64_t m_lastUsed{0};
+  };
+
+  std::unique_ptr<Node> m_root;
+  std::unordered_map<int, Node*> m_entries;
+  std::size_t m_tokenCount{0};
+  std::uint64_t m_clock{0};
+
+  const Node* most_recent_entry_below(const Node* node) const;
+  void prune(Node* node);
+};
+
+}  // namespace sentra
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sentra {
+
+// Detects an answer stuck in a loop: the newest tokens are the same block of
+// at most maxPeriod tokens repeated minCopies times back to back. Blocks are
+// compared through prefix rolling hashes, so each token costs O(maxPeriod);
+// hash hits are confirmed token by token. Short blocks need more copies: the
+// repeated run must also cover minTokens, so a row of dashes or blank lines
+// is not a loop.
+class RepetitionDetector {
+ public:
+  RepetitionDetector() = default;
+  RepetitionDetector(std::size_t maxPeriod, std::size_t minCopies, std::size_t minTokens = 0);
+
+  // Appends one token; returns true once the output ends in a loop.
+  bool push(std::int32_t token);
+  bool enabled() const;
+  // Length of the repeating block found by the last push() that returned true.
+  std::size_t period() const;
+  std::size_t copies() const;
+
+ private:
+  std::uint64_t segment_hash(std::size_t begin, std::size_t end) const;
+
+  std::size_t m_maxPeriod{0};
+  std::size_t m_minCopies{0};
+  std::size_t m_minTokens{0};
+  std::vector<std::int32_t> m_tokens;
+  std::vector<std::uint64_t> m_prefixHash{0};
+  std::vector<std::uint64_t> m_power{1};
+  std::size_t m_period{0};
+  std::size_t m_copies{0};
+};
+
+}  // namespace sentra
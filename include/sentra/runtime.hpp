@@ -2,7 +2,9 @@
 
 #include <functional>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "sentra/types.hpp"
 
@@ -14,8 +16,30 @@ struct LlamaRuntimeOptions {
   int m_nThreads{0};
   int m_nThreadsBatch{0};
   int m_nBatch{512};
+  int m_nUbatch{0};
+  int m_nParallel{1};
+  int m_prefixCacheEntries{4};
+  int m_prefixCacheMb{256};
+  std::string m_promptCacheDir;
+  bool m_keepPreviousModel{false};
+  std::string m_tuneDir;
+  // Linux cpulist ("0-15") or NUMA node whose CPUs run the compute threads;
+  // m_numa is off|distribute|isolate|numactl (empty: isolate when pinned to
+  // a node).
+  std::string m_cpuSet;
+  int m_numaNode{-1};
+  std::string m_numa;
+  int m_residentMb{0};
   bool m_offloadKqv{false};
   bool m_opOffload{false};
+  // f16|q8_0|q4_0 and on|off|auto; empty takes the profile default.
+  std::string m_kvCacheType;
+  std::string m_flashAttn;
+  int m_draftMax{8};
+  float m_draftPMin{0.75f};
+  bool m_ngramDraft{false};
+  int m_ngramMin{2};
+  int m_ngramMax{4};
   std::string m_profile{"balanced"};
 };
 
@@ -25,6 +49,36 @@ class IModelRuntime {
   virtual std::string name() const = 0;
   virtual bool is_available() const = 0;
   virtual GenerationResult generate(const GenerationRequest& request, StreamCallback on_token) = 0;
+  // Persists runtime-side state (e.g. the KV cache) for the session of the last
+  // request to its m_sessionStatePath. Stateless runtimes keep the no-op.
+  virtual void save_session_state() {}
+  // Starts loading the model in the background so the first request does not
+  // pay for it; on a model switch the current model keeps serving until the
+  // new one is ready. Runtimes without a load step keep the no-op.
+  virtual void preload(const std::string& modelPath) { (void)modelPath; }
+  // True once requests for modelPath no longer wait on a load.
+  virtual bool is_model_ready(const std::string& modelPath) const {
+    (void)modelPath;
+    return true;
+  }
+  // Tokens one request may occupy (prompt window plus reply). Runtimes that
+  // allocate a context size it from this, resizing before the next request.
+  virtual void set_context_tokens(std::size_t tokens) { (void)tokens; }
+  // Projected context memory for /status, e.g. "n_ctx 2560 (model max
+  // 32768), KV 320 MiB, compute ~180 MiB"; empty before a model is loaded.
+  virtual std::string memory_plan() const { return ""; }
+  // Benchmarks thread and batch settings for modelPath on this host, reports
+  // each measurement through on_progress and persists the fastest for later
+  // loads. Returns the path of the written settings.
+  virtual std::string tune(const std::string& modelPath, StreamCallback on_progress) {
+    (void)modelPath;
+    (void)on_progress;
+    throw std::runtime_error(name() + " runtime has no tunable settings");
+  }
+  // Model paths kept loaded besides the current one, most recently used first.
+  virtual std::vector<std::string> resident_models() const { return {}; }
+  // Load progress for /status, e.g. "loading 40%", "warming up" or "ready".
+  virtual std::string load_status() const { return "n/a"; }
 };
 
 std::unique_ptr<IModelRuntime> make_mock_runtime();
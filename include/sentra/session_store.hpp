@@ -8,6 +8,20 @@
 
 namespace sentra {
 
+// Appends a continuation to message. Token ids stay valid only when both
+// parts carry ids for the same model; otherwise they are dropped so prompt
+// assembly falls back to the text.
+void extend_message(Message& message, const Message& continuation);
+
+class SessionStore;
+
+// Adds the assistant answer in result to history and the session log. An
+// answer cancelled before its first token has no text and is recorded in
+// neither, so both keep the pending user turn alone. Returns whether the
+// answer was recorded.
+bool record_answer(const SessionStore& store, const std::string& sessionId, std::vector<Message>& history,
+                   const GenerationResult& result);
+
 class SessionStore {
  public:
   explicit SessionStore(std::string baseDir);
@@ -15,18 +29,26 @@ class SessionStore {
   std::string create_session_id() const;
   std::vector<Message> load(const std::string& sessionId) const;
   void append(const std::string& sessionId, const Message& message) const;
+  // Records text (and ids) generated by /continue for the last message; load()
+  // merges it into that message with extend_message().
+  void append_continuation(const std::string& sessionId, const Message& continuation) const;
+  // Records the answer chosen by /retry; load() replaces the last message
+  // with it.
+  void replace_last(const std::string& sessionId, const Message& message) const;
   void ensure_session(const std::string& sessionId, const std::string& activeModelId,
                       const std::string& runtimeName) const;
   void update_metadata(const std::string& sessionId, const std::string& activeModelId,
                        const std::string& runtimeName) const;
   std::optional<SessionMetadata> load_metadata(const std::string& sessionId) const;
   std::vector<SessionMetadata> list_sessions() const;
+  std::string kv_snapshot_path_for(const std::string& sessionId) const;
 
  private:
   std::string m_baseDir;
 
   std::string path_for(const std::string& sessionId) const;
   std::string metadata_path_for(const std::string& sessionId) const;
+  void write_record(const std::string& sessionId, const std::string& kind, const Message& message) const;
   static std::string escape(const std::string& input);
   static std::string unescape(const std::string& input);
 };
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace sentra {
+
+// Stop sequences of the "role: content" transcript the runtimes render: a
+// line that starts another turn means the answer is over.
+std::vector<std::string> transcript_stop_sequences();
+// Parses a stop_sequences config value: sequences separated by '|', with
+// "\n", "\t", "\|" and "\\" escapes. Empty sequences are skipped.
+std::vector<std::string> parse_stop_sequences(const std::string& value);
+
+// Matches stop sequences against generated text as it streams in. Text that
+// could still turn out to be the start of a stop sequence is held back, so
+// nothing past the match is ever streamed.
+class StopSequenceMatcher {
+ public:
+  StopSequenceMatcher() = default;
+  explicit StopSequenceMatcher(std::vector<std::string> sequences);
+
+  // Appends generated text and returns the part that is safe to stream now.
+  // Once a sequence matches, the text before it is released and later calls
+  // return nothing.
+  std::string feed(const std::string& text);
+  // Releases the held-back text when generation ends without a match.
+  std::string flush();
+
+  bool matched() const;
+  // Offset of the match in all text fed so far (the answer's final length).
+  std::size_t match_offset() const;
+  const std::string& matched_sequence() const;
+
+ private:
+  std::vector<std::string> m_sequences;
+  std::string m_text;
+  std::size_t m_released{0};
+  std::size_t m_scanFrom{0};
+  std::size_t m_longest{0};
+  std::size_t m_matchOffset{0};
+  std::string m_matched;
+  bool m_hasMatch{false};
+};
+
+}  // namespace sentra
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -17,13 +21,56 @@ Role role_from_string(const std::string& value);
 struct Message {
   Role m_role;
   std::string m_content;
+  // Exact token ids of m_content as produced by the runtime for model
+  // m_tokensModel. Lets prompt assembly splice them back verbatim instead of
+  // re-tokenizing text, which rarely reproduces the sampled ids.
+  std::vector<std::int32_t> m_tokens{};
+  std::string m_tokensModel{};
 };
 
+struct PrefillProgress {
+  std::size_t m_tokensDone{0};
+  std::size_t m_tokensTotal{0};
+  double m_tokensPerSecond{0.0};
+};
+
+using PrefillProgressCallback = std::function<void(const PrefillProgress&)>;
+
 struct GenerationRequest {
   std::vector<Message> m_messages;
   std::string m_modelId;
   std::string m_modelPath;
   std::size_t m_maxTokens{256};
+  std::string m_sessionStatePath;
+  std::string m_draftModelPath;
+  PrefillProgressCallback m_onPrefillProgress;
+  // Set from another thread or a signal handler to stop the turn early.
+  const std::atomic<bool>* m_cancel{nullptr};
+  // Generation ends as soon as the output contains one of these; the match
+  // itself is not part of the answer.
+  std::vector<std::string> m_stopSequences{};
+  // Stop once the output repeats a block of at most m_repeatWindow tokens
+  // m_repeatThreshold times in a row, covering at least m_repeatMinTokens;
+  // 0 disables the check.
+  std::size_t m_repeatWindow{0};
+  std::size_t m_repeatThreshold{2};
+  std::size_t m_repeatMinTokens{64};
+  // Wall-clock budget for the whole turn, prefill included; 0 = none. When
+  // it runs out the answer so far is returned with stop reason "time_budget".
+  std::size_t m_maxLatencyMs{0};
+  // The last message is an unfinished assistant answer: the prompt ends with
+  // it instead of a new "assistant: " header, and decoding picks up after it.
+  bool m_continueLast{false};
+  // Answers to sample for the same prompt. Extra samples are returned in
+  // GenerationResult::m_alternatives when the runtime supports them.
+  std::size_t m_samples{1};
+};
+
+// An extra answer sampled from the same prompt as the main one.
+struct GenerationAlternative {
+  std::string m_text;
+  std::vector<std::int32_t> m_tokens{};
+  std::string m_stopReason{};
 };
 
 struct GenerationResult {
@@ -34,6 +81,33 @@ struct GenerationResult {
   double m_totalMs{0.0};
   std::size_t m_generatedTokens{0};
   double m_tokensPerSecond{0.0};
+  std::size_t m_prefillTokens{0};
+  double m_prefillTokensPerSecond{0.0};
+  std::size_t m_reusedTokens{0};
+  std::size_t m_evictedTokens{0};
+  std::vector<std::int32_t> m_tokens{};
+  std::string m_tokensModel{};
+  std::size_t m_draftedTokens{0};
+  std::size_t m_acceptedDraftTokens{0};
+  // Stopped through GenerationRequest::m_cancel; m_text holds the partial answer.
+  bool m_cancelled{false};
+  // Why decode ended: "eos", "max_tokens", "stop_sequence", "repetition",
+  // "time_budget" or "cancelled".
+  std::string m_stopReason{};
+  // Tokens left in the max_tokens budget when a repetition loop was cut off.
+  std::size_t m_repetitionSavedTokens{0};
+  // Samples beyond the first, in the order they were produced.
+  std::vector<GenerationAlternative> m_alternatives{};
+};
+
+struct PerfTotals {
+  std::size_t m_turns{0};
+  std::size_t m_generatedTokens{0};
+  double m_totalMs{0.0};
+  std::size_t m_draftedTokens{0};
+  std::size_t m_acceptedDraftTokens{0};
+  std::size_t m_repetitionStops{0};
+  std::size_t m_repetitionSavedTokens{0};
 };
 
 struct ModelSpec {
@@ -1,5 +1,8 @@
 #include "sentra/repl.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <csignal>
 #include <cstdlib>
 #include <filesystem>
 #include <iomanip>
@@ -17,6 +20,41 @@
 namespace sentra {
 namespace {
 
+// Set from SIGINT while a turn is generating; the runtime polls it between
+// tokens and through llama's abort callback during prefill.
+std::atomic<bool> g_turnInterrupted{false};
+static_assert(std::atomic<bool>::is_always_lock_free, "flag must be usable from a signal handler");
+
+void on_turn_interrupt(int) { g_turnInterrupted.store(true); }
+
+// Upper bound for /retry n; each alternative needs its own KV sequence.
+constexpr std::size_t kMaxRetrySamples = 8;
+
+// Routes Ctrl-C to g_turnInterrupted for the duration of one turn, so
+// stopping an answer keeps the process, the loaded model and its KV cache.
+// The previous disposition is restored afterwards.
+class TurnInterruptScope {
+ public:
+  TurnInterruptScope() {
+    g_turnInterrupted.store(false);
+    struct sigaction action {};
+    action.sa_handler = on_turn_interrupt;
+    sigemptyset(&action.sa_mask);
+    m_installed = sigaction(SIGINT, &action, &m_previous) == 0;
+  }
+  ~TurnInterruptScope() {
+    if (m_installed) {
+      sigaction(SIGINT, &m_previous, nullptr);
+    }
+  }
+  TurnInterruptScope(const TurnInterruptScope&) = delete;
+  TurnInterruptScope& operator=(const TurnInterruptScope&) = delete;
+
+ private:
+  struct sigaction m_previous {};
+  bool m_installed{false};
+};
+
 void print_model_line(const ModelSpec& model, bool active) {
   const bool ready = std::filesystem::exists(model.m_localPath);
   std::cout << (active ? "* " : "  ") << model.m_id << " | " << model.m_name
@@ -405,6 +443,12 @@ bool is_positive_integer(const std::string& text) {
   return true;
 }
 
+void print_memory_plan(const Orchestrator& orchestrator) {
+  if (const std::string plan = orchestrator.memory_plan(); !plan.empty()) {
+    std::cout << "memory_plan: " << plan << "\n";
+  }
+}
+
 void print_status_line_items(const Orchestrator& orchestrator, const std::string& sessionId, bool rawStreamMode) {
   std::cout << "session: " << sessionId << "\n";
   std::cout << "runtime: " << orchestrator.active_runtime_name() << "\n";
@@ -413,9 +457,41 @@ void print_status_line_items(const Orchestrator& orchestrator, const std::string
   } else {
     std::cout << "model: none\n";
   }
+  std::cout << "model_load: " << orchestrator.model_load_status() << "\n";
+  print_memory_plan(orchestrator);
+  if (const auto resident = orchestrator.resident_model_ids(); !resident.empty()) {
+    std::cout << "resident_models:";
+    for (const auto& id : resident) {
+      std::cout << " " << id;
+    }
+    std::cout << "\n";
+  }
   std::cout << "profile: " << orchestrator.profile() << "\n";
   std::cout << "max_tokens: " << orchestrator.max_tokens() << "\n";
+  std::cout << "max_latency_ms: " << orchestrator.max_latency_ms() << "\n";
   std::cout << "context_window_tokens: " << orchestrator.context_window_tokens() << "\n";
+  std::cout << "context_prune: " << orchestrator.context_prune_policy();
+  if (orchestrator.context_prune_policy() == "hysteresis") {
+    std::cout << " (low_water=" << std::fixed << std::setprecision(2) << orchestrator.context_low_water() << ")";
+  }
+  std::cout << "\n";
+  std::cout << "context_prefix_stable_turns: " << orchestrator.prefix_stable_turns() << "\n";
+  const PerfTotals perf = orchestrator.perf_totals();
+  std::cout << "speculative: " << orchestrator.speculative_mode() << "\n";
+  if (perf.m_draftedTokens > 0) {
+    std::cout << "draft_acceptance: " << std::fixed << std::setprecision(1)
+              << 100.0 * static_cast<double>(perf.m_acceptedDraftTokens) / static_cast<double>(perf.m_draftedTokens)
+              << "% (" << perf.m_acceptedDraftTokens << "/" << perf.m_draftedTokens << ")\n";
+  }
+  if (perf.m_totalMs > 0.0) {
+    std::cout << "effective_tps: " << std::fixed << std::setprecision(1)
+              << static_cast<double>(perf.m_generatedTokens) * 1000.0 / perf.m_totalMs << " (" << perf.m_turns
+              << " turns)\n";
+  }
+  if (perf.m_repetitionStops > 0) {
+    std::cout << "repetition_stops: " << perf.m_repetitionStops << " (saved " << perf.m_repetitionSavedTokens
+              << " tokens)\n";
+  }
   std::cout << "stream_mode: " << (rawStreamMode ? "raw" : "render") << "\n";
   if (!orchestrator.runtime_selection_note().empty()) {
     std::cout << "note: " << orchestrator.runtime_selection_note() << "\n";
@@ -485,6 +561,83 @@ std::string normalize_user_shortcut(const std::string& input) {
   return raw;
 }
 
+enum class TurnKind { Answer, Continue, Retry };
+
+// Runs one turn (or extends or re-answers the last assistant message),
+// streaming or rendering the answer and printing its [warn]/[perf] lines.
+// Ctrl-C stops only the answer while it runs. Retry alternatives beyond the
+// first are left in the result for the caller to show.
+GenerationResult stream_turn(Orchestrator& orchestrator, const std::vector<Message>& history, TurnKind kind,
+                             bool rawStreamMode, std::size_t samples = 1) {
+  bool prefillLineShown = false;
+  const StreamCallback onToken = [&](const std::string& token) {
+    if (rawStreamMode) {
+      std::cout << token;
+      std::cout.flush();
+    }
+  };
+  const PrefillProgressCallback onPrefill = [&](const PrefillProgress& progress) {
+    // Single-chunk prefills finish before anything is shown; only long
+    // prompts get a live progress line, which is replaced once done.
+    if (progress.m_tokensDone >= progress.m_tokensTotal) {
+      if (prefillLineShown) {
+        std::cout << "\r\033[Ksentra> ";
+        std::cout.flush();
+      }
+      return;
+    }
+    std::cout << "\r\033[K[prefill] " << progress.m_tokensDone << "/" << progress.m_tokensTotal << " tokens "
+              << std::fixed << std::setprecision(1) << progress.m_tokensPerSecond << " tok/s";
+    std::cout.flush();
+    prefillLineShown = true;
+  };
+  std::optional<TurnInterruptScope> interruptScope(std::in_place);
+  GenerationResult result;
+  switch (kind) {
+    case TurnKind::Answer:
+      result = orchestrator.respond(history, onToken, onPrefill, &g_turnInterrupted);
+      break;
+    case TurnKind::Continue:
+      result = orchestrator.continue_answer(history, onToken, onPrefill, &g_turnInterrupted);
+      break;
+    case TurnKind::Retry:
+      result = orchestrator.retry_answer(history, samples, onToken, onPrefill, &g_turnInterrupted);
+      break;
+  }
+  interruptScope.reset();
+  if (!rawStreamMode) {
+    std::cout << render_markdown_for_terminal(result.m_text);
+  }
+  std::cout << (result.m_cancelled ? " [cancelled]\n" : "\n");
+  if (!result.m_warning.empty()) {
+    std::cout << "[warn] " << result.m_warning << "\n";
+  }
+  if (result.m_totalMs > 0.0) {
+    std::cout << "[perf] first_token=" << std::fixed << std::setprecision(1) << result.m_firstTokenMs
+              << "ms total=" << result.m_totalMs << "ms tokens=" << result.m_generatedTokens
+              << " tps=" << result.m_tokensPerSecond;
+    if (result.m_prefillTokens > 0 || result.m_reusedTokens > 0) {
+      std::cout << " reused=" << result.m_reusedTokens << " prefill=" << result.m_prefillTokens
+                << " prefill_tps=" << result.m_prefillTokensPerSecond;
+    }
+    if (result.m_evictedTokens > 0) {
+      std::cout << " evicted=" << result.m_evictedTokens;
+    }
+    if (result.m_draftedTokens > 0) {
+      std::cout << " draft_accept=" << result.m_acceptedDraftTokens << "/" << result.m_draftedTokens << " ("
+                << 100.0 * static_cast<double>(result.m_acceptedDraftTokens) /
+                       static_cast<double>(result.m_draftedTokens)
+                << "%)";
+    }
+    if (!result.m_stopReason.empty()) {
+      std::cout << " stop=" << result.m_stopReason;
+    }
+    std::cout << "\n";
+  }
+  std::cout << "\n";
+  return result;
+}
+
 }  // namespace
 
 Repl::Repl(std::string sessionId, SessionStore&& sessionStore, Orchestrator&& orchestrator,
@@ -499,6 +652,9 @@ int Repl::run() {
   const auto startupModel = m_orchestrator.active_model();
   const std::string startupModelId = startupModel.has_value() ? startupModel->get().m_id : "";
   m_sessionStore.ensure_session(m_sessionId, startupModelId, m_orchestrator.active_runtime_name());
+  m_orchestrator.set_session_state_path(m_sessionStore.kv_snapshot_path_for(m_sessionId));
+  // Load and warm the model while the user types the first question.
+  m_orchestrator.preload_active_model();
 
   if (history.empty()) {
     const Message systemMsg{Role::System, m_systemPrompt};
@@ -566,8 +722,13 @@ int Repl::run() {
       std::cout << "/status               Show current session/runtime/model\n";
       std::cout << "/clear                Clear terminal\n";
       std::cout << "/profile <mode>       Set profile: fast|balanced|quality\n";
+      std::cout << "/continue             Keep generating the last answer\n";
+      std::cout << "/retry [n]            Answer the last message again (n alternatives)\n";
       std::cout << "/set max_tokens <n>   Set max output tokens\n";
+      std::cout << "/set max_ms <n>       Set wall-clock budget per turn in ms (0 = none)\n";
       std::cout << "/set context <n>      Set context window tokens\n";
+      std::cout << "/set prune <policy>   Set context pruning: sliding|hysteresis\n";
+      std::cout << "/set low_water <r>    Set hysteresis low-water ratio (0.1-0.95)\n";
       std::cout << "/set stream <mode>    Set stream mode: raw|render\n";
       std::cout << "/menu                 Show numbered menu\n";
       std::cout << "/menu run <n>         Run menu action by number\n";
@@ -781,8 +942,13 @@ int Repl::run() {
         std::cout << "/status               Show current session/runtime/model\n";
         std::cout << "/clear                Clear terminal\n";
         std::cout << "/profile <mode>       Set profile: fast|balanced|quality\n";
+        std::cout << "/continue             Keep generating the last answer\n";
+        std::cout << "/retry [n]            Answer the last message again (n alternatives)\n";
         std::cout << "/set max_tokens <n>   Set max output tokens\n";
+        std::cout << "/set max_ms <n>       Set wall-clock budget per turn in ms (0 = none)\n";
         std::cout << "/set context <n>      Set context window tokens\n";
+        std::cout << "/set prune <policy>   Set context pruning: sliding|hysteresis\n";
+        std::cout << "/set low_water <r>    Set hysteresis low-water ratio (0.1-0.95)\n";
         std::cout << "/set stream <mode>    Set stream mode: raw|render\n";
         std::cout << "/menu                 Show numbered menu\n";
         std::cout << "/menu run <n>         Run menu action by number\n";
@@ -816,9 +982,12 @@ int Repl::run() {
       }
       rawStreamMode = (m_orchestrator.profile() == "fast");
       std::cout << "profile set: " << m_orchestrator.profile() << "\n";
-      std::cout << "max_tokens: " << m_orchestrator.max_tokens() << ", context_window_tokens: "
+      std::cout << "max_tokens: " << m_orchestrator.max_tokens()
+                << ", max_latency_ms: " << m_orchestrator.max_latency_ms() << ", context_window_tokens: "
                 << m_orchestrator.context_window_tokens() << ", stream_mode: "
-                << (rawStreamMode ? "raw" : "render") << "\n\n";
+                << (rawStreamMode ? "raw" : "render") << "\n";
+      print_memory_plan(m_orchestrator);
+      std::cout << "\n";
       continue;
     }
 
@@ -834,18 +1003,136 @@ int Repl::run() {
       continue;
     }
 
+    if (line == "/continue") {
+      if (history.empty() || history.back().m_role != Role::Assistant) {
+        std::cout << "error: no answer to continue\n\n";
+        continue;
+      }
+      std::cout << "sentra> ";
+      try {
+        const GenerationResult result = stream_turn(m_orchestrator, history, TurnKind::Continue, rawStreamMode);
+        if (result.m_text.empty()) {
+          continue;
+        }
+        const Message continuation{Role::Assistant, result.m_text, result.m_tokens, result.m_tokensModel};
+        extend_message(history.back(), continuation);
+        m_sessionStore.append_continuation(m_sessionId, continuation);
+      } catch (const std::exception& ex) {
+        std::cout << "\nerror: " << ex.what() << "\n\n";
+      }
+      continue;
+    }
+
+    if (line == "/retry" || line.rfind("/retry ", 0) == 0) {
+      if (history.empty() || history.back().m_role != Role::Assistant) {
+        std::cout << "error: no answer to retry\n\n";
+        continue;
+      }
+      std::size_t samples = 1;
+      if (const std::string value = trim(line.substr(std::string("/retry").size())); !value.empty()) {
+        try {
+          samples = std::clamp<std::size_t>(static_cast<std::size_t>(std::stoull(value)), 1, kMaxRetrySamples);
+        } catch (...) {
+          std::cout << "error: invalid retry count: " << value << "\n\n";
+          continue;
+        }
+      }
+      std::cout << "sentra> ";
+      try {
+        GenerationResult result = stream_turn(m_orchestrator, history, TurnKind::Retry, rawStreamMode, samples);
+        if (result.m_text.empty() && result.m_alternatives.empty()) {
+          // Cancelled before the first token: keep the previous answer.
+          continue;
+        }
+        Message chosen{Role::Assistant, result.m_text, result.m_tokens, result.m_tokensModel};
+        if (!result.m_alternatives.empty()) {
+          for (std::size_t k = 0; k < result.m_alternatives.size(); ++k) {
+            std::cout << "--- alternative " << k + 2 << " ---\n"
+                      << render_markdown_for_terminal(result.m_alternatives[k].m_text) << "\n";
+          }
+          const std::size_t count = result.m_alternatives.size() + 1;
+          std::cout << "choose [1-" << count << "] (enter = 1): ";
+          std::string choice;
+          std::getline(std::cin, choice);
+          std::size_t index = 1;
+          if (!trim(choice).empty()) {
+            try {
+              index = static_cast<std::size_t>(std::stoul(trim(choice)));
+            } catch (...) {
+              index = 0;
+            }
+          }
+          if (index == 0 || index > count) {
+            std::cout << "error: choice out of range; keeping 1\n";
+            index = 1;
+          }
+          if (index > 1) {
+            GenerationAlternative& alternative = result.m_alternatives[index - 2];
+            chosen.m_content = std::move(alternative.m_text);
+            chosen.m_tokens = std::move(alternative.m_tokens);
+            if (chosen.m_tokens.empty()) {
+              chosen.m_tokensModel.clear();
+            }
+          }
+          std::cout << "\n";
+        }
+        history.back() = chosen;
+        m_sessionStore.replace_last(m_sessionId, chosen);
+      } catch (const std::exception& ex) {
+        std::cout << "\nerror: " << ex.what() << "\n\n";
+      }
+      continue;
+    }
+
+    if (line.rfind("/set max_ms ", 0) == 0) {
+      const std::string value = trim(line.substr(std::string("/set max_ms ").size()));
+      try {
+        const std::size_t n = static_cast<std::size_t>(std::stoull(value));
+        m_orchestrator.set_max_latency_ms(n);
+        std::cout << "max_latency_ms set to " << m_orchestrator.max_latency_ms() << "\n\n";
+      } catch (...) {
+        std::cout << "error: invalid max_ms value: " << value << "\n\n";
+      }
+      continue;
+    }
+
     if (line.rfind("/set context ", 0) == 0) {
       const std::string value = trim(line.substr(std::string("/set context ").size()));
       try {
         const std::size_t n = static_cast<std::size_t>(std::stoull(value));
         m_orchestrator.set_context_window_tokens(n);
-        std::cout << "context_window_tokens set to " << m_orchestrator.context_window_tokens() << "\n\n";
+        std::cout << "context_window_tokens set to " << m_orchestrator.context_window_tokens() << "\n";
+        print_memory_plan(m_orchestrator);
+        std::cout << "\n";
       } catch (...) {
         std::cout << "error: invalid context token value: " << value << "\n\n";
       }
       continue;
     }
 
+    if (line.rfind("/set prune ", 0) == 0) {
+      const std::string value = to_lower(trim(line.substr(std::string("/set prune ").size())));
+      std::string error;
+      if (!m_orchestrator.set_context_prune_policy(value, error)) {
+        std::cout << "error: " << error << "\n\n";
+      } else {
+        std::cout << "context prune policy set to " << m_orchestrator.context_prune_policy() << "\n\n";
+      }
+      continue;
+    }
+
+    if (line.rfind("/set low_water ", 0) == 0) {
+      const std::string value = trim(line.substr(std::string("/set low_water ").size()));
+      try {
+        m_orchestrator.set_context_low_water(std::stod(value));
+        std::cout << "context low-water ratio set to " << std::fixed << std::setprecision(2)
+                  << m_orchestrator.context_low_water() << "\n\n";
+      } catch (...) {
+        std::cout << "error: invalid low-water ratio: " << value << "\n\n";
+      }
+      continue;
+    }
+
     if (line.rfind("/set stream ", 0) == 0) {
       const std::string value = to_lower(trim(line.substr(std::string("/set stream ").size())));
       if (value == "raw") {
@@ -1025,7 +1312,12 @@ int Repl::run() {
         const auto active = m_orchestrator.active_model();
         if (active.has_value()) {
           m_sessionStore.update_metadata(m_sessionId, active->get().m_id, m_orchestrator.active_runtime_name());
-          std::cout << "active model: " << active->get().m_id << "\n\n";
+          std::cout << "active model: " << active->get().m_id;
+          const std::string loadStatus = m_orchestrator.model_load_status();
+          if (loadStatus.rfind("loading", 0) == 0) {
+            std::cout << " (" << loadStatus << " in background)";
+          }
+          std::cout << "\n\n";
         }
       }
       continue;
@@ -1147,31 +1439,10 @@ int Repl::run() {
 
     std::cout << "sentra> ";
     try {
-      std::string streamed;
-      auto result = m_orchestrator.respond(history, [&](const std::string& token) {
-        streamed += token;
-        if (rawStreamMode) {
-          std::cout << token;
-          std::cout.flush();
-        }
-      });
-      if (!rawStreamMode) {
-        std::cout << render_markdown_for_terminal(result.m_text);
-      }
-      std::cout << "\n";
-      if (result.m_contextTruncated && !result.m_warning.empty()) {
-        std::cout << "[warn] " << result.m_warning << "\n";
-      }
-      if (result.m_totalMs > 0.0) {
-        std::cout << "[perf] first_token=" << std::fixed << std::setprecision(1) << result.m_firstTokenMs
-                  << "ms total=" << result.m_totalMs << "ms tokens=" << result.m_generatedTokens
-                  << " tps=" << result.m_tokensPerSecond << "\n";
+      const GenerationResult result = stream_turn(m_orchestrator, history, TurnKind::Answer, rawStreamMode);
+      if (!record_answer(m_sessionStore, m_sessionId, history, result)) {
+        continue;
       }
-      std::cout << "\n";
-
-      Message assistantMsg{Role::Assistant, result.m_text};
-      history.push_back(assistantMsg);
-      m_sessionStore.append(m_sessionId, assistantMsg);
       if (!extract_shell_blocks_from_history(history).empty()) {
         std::cout << "[tip] assistant included shell code. review with /code shell\n\n";
       }
@@ -1183,6 +1454,7 @@ int Repl::run() {
     }
   }
 
+  m_orchestrator.save_session_state();
   return 0;
 }
 
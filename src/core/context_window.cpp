@@ -74,4 +74,78 @@ ContextPruneResult prune_context_window(const std::vector<Message>& history, std
   return result;
 }
 
+ContextPruneResult prune_context_window_stable(const std::vector<Message>& history, std::size_t tokenBudget,
+                                               std::size_t lowWaterTokens, std::size_t firstKeptIndex) {
+  ContextPruneResult result;
+  if (history.empty()) {
+    return result;
+  }
+
+  std::size_t systemTokens = 0;
+  for (const auto& message : history) {
+    if (message.m_role == Role::System) {
+      systemTokens += estimate_tokens(message.m_content);
+    }
+  }
+
+  std::size_t cut = std::min(firstKeptIndex, history.size() - 1);
+  std::size_t tailTokens = 0;
+  for (std::size_t i = cut; i < history.size(); ++i) {
+    if (history[i].m_role != Role::System) {
+      tailTokens += estimate_tokens(history[i].m_content);
+    }
+  }
+
+  if (systemTokens + tailTokens > tokenBudget) {
+    const std::size_t target = std::min(lowWaterTokens, tokenBudget);
+    while (cut + 1 < history.size() && systemTokens + tailTokens > target) {
+      if (history[cut].m_role != Role::System) {
+        tailTokens -= estimate_tokens(history[cut].m_content);
+      }
+      ++cut;
+    }
+  }
+
+  result.m_firstKeptIndex = cut;
+  result.m_tokensKept = systemTokens + tailTokens;
+  result.m_messages.reserve(history.size() - cut + 1);
+  for (std::size_t i = 0; i < history.size(); ++i) {
+    if (history[i].m_role == Role::System || i >= cut) {
+      result.m_messages.push_back(history[i]);
+    } else {
+      result.m_truncated = true;
+    }
+  }
+  return result;
+}
+
+ContextPruneResult prune_to_token_counts(const std::vector<Message>& messages,
+                                         const std::vector<std::size_t>& messageTokens, std::size_t tokenBudget) {
+  ContextPruneResult result;
+  std::size_t total = 0;
+  for (std::size_t i = 0; i < messages.size(); ++i) {
+    total += i < messageTokens.size() ? messageTokens[i] : 0;
+  }
+
+  std::size_t cut = 0;
+  while (total > tokenBudget && cut + 1 < messages.size()) {
+    if (messages[cut].m_role != Role::System) {
+      total -= cut < messageTokens.size() ? messageTokens[cut] : 0;
+    }
+    ++cut;
+  }
+
+  result.m_firstKeptIndex = cut;
+  result.m_tokensKept = total;
+  result.m_messages.reserve(messages.size());
+  for (std::size_t i = 0; i < messages.size(); ++i) {
+    if (messages[i].m_role == Role::System || i >= cut) {
+      result.m_messages.push_back(messages[i]);
+    } else {
+      result.m_truncated = true;
+    }
+  }
+  return result;
+}
+
 }  // namespace sentra
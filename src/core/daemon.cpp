@@ -0,0 +1,486 @@
+#include "sentra/daemon.hpp"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace sentra {
+namespace {
+
+std::string escape_field(const std::string& input) {
+  std::string out;
+  out.reserve(input.size());
+  for (char c : input) {
+    if (c == '\\') {
+      out += "\\\\";
+    } else if (c == '\n') {
+      out += "\\n";
+    } else if (c == '\t') {
+      out += "\\t";
+    } else if (c == '\r') {
+      out += "\\r";
+    } else {
+      out.push_back(c);
+    }
+  }
+  return out;
+}
+
+std::string unescape_field(const std::string& input) {
+  std::string out;
+  out.reserve(input.size());
+  for (std::size_t i = 0; i < input.size(); ++i) {
+    if (input[i] == '\\' && i + 1 < input.size()) {
+      const char next = input[++i];
+      if (next == 'n') {
+        out.push_back('\n');
+      } else if (next == 't') {
+        out.push_back('\t');
+      } else if (next == 'r') {
+        out.push_back('\r');
+      } else {
+        out.push_back(next);
+      }
+      continue;
+    }
+    out.push_back(input[i]);
+  }
+  return out;
+}
+
+sockaddr_un make_address(const std::string& path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("invalid daemon socket path (empty or too long): " + path);
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return addr;
+}
+
+int connect_socket(const std::string& path) {
+  const sockaddr_un addr = make_address(path);
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool write_all(int fd, const std::string& data) {
+  std::size_t written = 0;
+  while (written < data.size()) {
+    const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    written += static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+bool send_frame(int fd, const std::vector<std::string>& fields) { return write_all(fd, encode_frame(fields)); }
+
+// Reads one newline-terminated frame, keeping any bytes past it in buffer.
+bool read_line(int fd, std::string& buffer, std::string& line) {
+  while (true) {
+    const auto newline = buffer.find('\n');
+    if (newline != std::string::npos) {
+      line = buffer.substr(0, newline);
+      buffer.erase(0, newline + 1);
+      return true;
+    }
+    char chunk[4096];
+    const ssize_t n = ::read(fd, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buffer.append(chunk, static_cast<std::size_t>(n));
+  }
+}
+
+std::string format_perf(const GenerationResult& result) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1) << "first_token=" << result.m_firstTokenMs
+      << "ms total=" << result.m_totalMs << "ms tokens=" << result.m_generatedTokens
+      << " tps=" << result.m_tokensPerSecond << " reused=" << result.m_reusedTokens
+      << " prefill=" << result.m_prefillTokens;
+  if (result.m_draftedTokens > 0) {
+    out << " draft_accept=" << result.m_acceptedDraftTokens << "/" << result.m_draftedTokens;
+  }
+  if (!result.m_stopReason.empty()) {
+    out << " stop=" << result.m_stopReason;
+  }
+  return out.str();
+}
+
+}  // namespace
+
+std::string encode_frame(const std::vector<std::string>& fields) {
+  std::string out;
+  for (std::size_t i = 0; i < fields.size(); ++i) {
+    if (i > 0) {
+      out.push_back('\t');
+    }
+    out += escape_field(fields[i]);
+  }
+  out.push_back('\n');
+  return out;
+}
+
+std::vector<std::string> decode_frame(const std::string& line) {
+  std::vector<std::string> fields;
+  std::size_t start = 0;
+  while (true) {
+    const auto tab = line.find('\t', start);
+    fields.push_back(unescape_field(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start)));
+    if (tab == std::string::npos) {
+      break;
+    }
+    start = tab + 1;
+  }
+  return fields;
+}
+
+Daemon::Daemon(std::string socketPath, SessionStore&& sessionStore, Orchestrator&& orchestrator,
+               std::string systemPrompt)
+    : m_socketPath(std::move(socketPath)),
+      m_sessionStore(std::move(sessionStore)),
+      m_orchestrator(std::move(orchestrator)),
+      m_systemPrompt(std::move(systemPrompt)) {}
+
+bool is_valid_session_id(const std::string& sessionId) {
+  if (sessionId.empty()) {
+    return false;
+  }
+  for (const char c : sessionId) {
+    const bool allowed = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' ||
+                         c == '-';
+    if (!allowed) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int Daemon::run() {
+  // A client that disconnects mid-stream must not take the daemon down.
+  std::signal(SIGPIPE, SIG_IGN);
+
+  if (const int existing = connect_socket(m_socketPath); existing >= 0) {
+    ::close(existing);
+    throw std::runtime_error("a daemon is already listening on " + m_socketPath);
+  }
+  const std::filesystem::path parent = std::filesystem::path(m_socketPath).parent_path();
+  if (!parent.empty()) {
+    std::filesystem::create_directories(parent);
+  }
+  ::unlink(m_socketPath.c_str());
+
+  const sockaddr_un addr = make_address(m_socketPath);
+  m_listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m_listenFd < 0) {
+    throw std::runtime_error("failed to create daemon socket: " + std::string(std::strerror(errno)));
+  }
+  // The socket file takes its mode from the umask at bind time, so it is
+  // never reachable by other users, not even briefly.
+  const mode_t previousUmask = ::umask(0077);
+  const bool bound = ::bind(m_listenFd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0;
+  const int bindErrno = errno;
+  ::umask(previousUmask);
+  if (!bound || ::listen(m_listenFd, 16) != 0) {
+    const std::string reason = std::strerror(bound ? errno : bindErrno);
+    ::close(m_listenFd);
+    throw std::runtime_error("failed to listen on " + m_socketPath + ": " + reason);
+  }
+
+  m_orchestrator.preload_active_model();
+  std::cout << "sentra daemon listening on " << m_socketPath << " (runtime: " << m_orchestrator.active_runtime_name()
+            << ")\n";
+  std::cout.flush();
+
+  while (!m_stopRequested.load()) {
+    const int fd = ::accept(m_listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (m_stopRequested.load()) {
+      ::close(fd);
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_clientsMutex);
+      m_clientFds.insert(fd);
+    }
+    std::thread([this, fd] {
+      serve_client(fd);
+      std::lock_guard<std::mutex> lock(m_clientsMutex);
+      m_clientFds.erase(fd);
+      ::close(fd);
+      m_clientsIdle.notify_all();
+    }).detach();
+  }
+
+  {
+    // Unblock clients waiting on input, then wait for every handler to finish
+    // before the orchestrator goes away.
+    std::unique_lock<std::mutex> lock(m_clientsMutex);
+    for (int fd : m_clientFds) {
+      ::shutdown(fd, SHUT_RDWR);
+    }
+    m_clientsIdle.wait(lock, [&] { return m_clientFds.empty(); });
+  }
+  m_orchestrator.save_session_state();
+  ::close(m_listenFd);
+  ::unlink(m_socketPath.c_str());
+  std::cout << "sentra daemon stopped\n";
+  return 0;
+}
+
+void Daemon::serve_client(int fd) {
+  std::string buffer;
+  std::string line;
+  while (read_line(fd, buffer, line)) {
+    const std::vector<std::string> frame = decode_frame(line);
+    const std::string& command = frame[0];
+    if (command == "ping") {
+      send_frame(fd, {"done"});
+    } else if (command == "status") {
+      handle_status(fd);
+    } else if (command == "prompt" && frame.size() >= 3) {
+      handle_prompt(fd, frame[1], frame[2]);
+    } else if (command == "shutdown") {
+      send_frame(fd, {"done"});
+      m_stopRequested.store(true);
+      // Wake the accept loop; it rechecks the flag on every connection.
+      if (const int wake = connect_socket(m_socketPath); wake >= 0) {
+        ::close(wake);
+      }
+      return;
+    } else {
+      send_frame(fd, {"error", "unknown request: " + command});
+    }
+  }
+}
+
+void Daemon::handle_prompt(int fd, std::string sessionId, const std::string& text) {
+  if (!sessionId.empty() && !is_valid_session_id(sessionId)) {
+    send_frame(fd, {"error", "invalid session id: " + sessionId});
+    return;
+  }
+  try {
+    const auto active = m_orchestrator.active_model();
+    const std::string activeModelId = active.has_value() ? active->get().m_id : "";
+    std::shared_ptr<std::mutex> sessionMutex;
+    {
+      // Session ids are second-granular; disambiguate clients that start a
+      // new session in the same second.
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (sessionId.empty()) {
+        const std::string base = m_sessionStore.create_session_id();
+        sessionId = base;
+        for (int n = 2; m_sessionStore.load_metadata(sessionId).has_value(); ++n) {
+          sessionId = base + "-" + std::to_string(n);
+        }
+      }
+      m_sessionStore.ensure_session(sessionId, activeModelId, m_orchestrator.active_runtime_name());
+      std::shared_ptr<std::mutex>& slot = m_sessionMutexes[sessionId];
+      if (!slot) {
+        slot = std::make_shared<std::mutex>();
+      }
+      sessionMutex = slot;
+    }
+    send_frame(fd, {"session", sessionId});
+
+    // Turns of different sessions run concurrently; the llama runtime decodes
+    // each in its own sequence and parks idle ones in their KV snapshots.
+    std::lock_guard<std::mutex> sessionLock(*sessionMutex);
+    std::vector<Message> history = m_sessionStore.load(sessionId);
+    if (history.empty()) {
+      const Message systemMsg{Role::System, m_systemPrompt};
+      history.push_back(systemMsg);
+      m_sessionStore.append(sessionId, systemMsg);
+    }
+
+    const Message userMsg{Role::User, text};
+    history.push_back(userMsg);
+    m_sessionStore.append(sessionId, userMsg);
+
+    // Stop generating once the client goes away; the text streamed so far is
+    // still recorded.
+    std::atomic<bool> disconnected{false};
+    const GenerationResult result = m_orchestrator.respond_in_session(
+        m_sessionStore.kv_snapshot_path_for(sessionId), history,
+        [&](const std::string& token) {
+          if (!disconnected.load() && !send_frame(fd, {"token", token})) {
+            disconnected.store(true);
+          }
+        },
+        nullptr, &disconnected);
+
+    record_answer(m_sessionStore, sessionId, history, result);
+    m_sessionStore.update_metadata(sessionId, activeModelId, m_orchestrator.active_runtime_name());
+    if (!result.m_warning.empty()) {
+      send_frame(fd, {"warn", result.m_warning});
+    }
+    if (result.m_totalMs > 0.0) {
+      send_frame(fd, {"perf", format_perf(result)});
+    }
+    send_frame(fd, {"done"});
+  } catch (const std::exception& ex) {
+    send_frame(fd, {"error", ex.what()});
+  }
+}
+
+void Daemon::handle_status(int fd) {
+  const auto active = m_orchestrator.active_model();
+  const PerfTotals totals = m_orchestrator.perf_totals();
+  std::size_t clientCount = 0;
+  {
+    std::lock_guard<std::mutex> clientsLock(m_clientsMutex);
+    clientCount = m_clientFds.size();
+  }
+  send_frame(fd, {"info", "runtime: " + m_orchestrator.active_runtime_name()});
+  send_frame(fd, {"info", "active_model: " + (active.has_value() ? active->get().m_id : std::string("none"))});
+  send_frame(fd, {"info", "model_load: " + m_orchestrator.model_load_status()});
+  if (const std::string plan = m_orchestrator.memory_plan(); !plan.empty()) {
+    send_frame(fd, {"info", "memory_plan: " + plan});
+  }
+  send_frame(fd, {"info", "speculative: " + m_orchestrator.speculative_mode()});
+  send_frame(fd, {"info", "clients: " + std::to_string(clientCount)});
+  send_frame(fd, {"info", "turns: " + std::to_string(totals.m_turns) +
+                              " generated_tokens: " + std::to_string(totals.m_generatedTokens) +
+                              " repetition_stops: " + std::to_string(totals.m_repetitionStops) +
+                              " repetition_saved_tokens: " + std::to_string(totals.m_repetitionSavedTokens)});
+  send_frame(fd, {"done"});
+}
+
+namespace {
+
+// Sends one request and prints the streamed reply. Returns false on an error
+// frame or a dropped connection.
+bool exchange(int fd, std::string& buffer, const std::vector<std::string>& request, std::string& sessionId) {
+  if (!send_frame(fd, request)) {
+    std::cerr << "error: daemon connection closed\n";
+    return false;
+  }
+  std::string line;
+  bool streaming = false;
+  while (read_line(fd, buffer, line)) {
+    const std::vector<std::string> frame = decode_frame(line);
+    const std::string& kind = frame[0];
+    const std::string value = frame.size() > 1 ? frame[1] : "";
+    if (kind == "token") {
+      std::cout << value;
+      std::cout.flush();
+      streaming = true;
+      continue;
+    }
+    if (streaming && kind != "session") {
+      std::cout << "\n";
+      std::cout.flush();
+      streaming = false;
+    }
+    if (kind == "session") {
+      sessionId = value;
+    } else if (kind == "info") {
+      std::cout << value << "\n";
+    } else if (kind == "warn") {
+      std::cerr << "[warn] " << value << "\n";
+    } else if (kind == "perf") {
+      std::cerr << "[perf] " << value << "\n";
+    } else if (kind == "error") {
+      std::cerr << "error: " << value << "\n";
+      return false;
+    } else if (kind == "done") {
+      return true;
+    }
+  }
+  std::cerr << "error: daemon connection closed\n";
+  return false;
+}
+
+int connect_or_report(const std::string& socketPath) {
+  const int fd = connect_socket(socketPath);
+  if (fd < 0) {
+    std::cerr << "error: no daemon listening on " << socketPath << " (start one with: sentra --daemon)\n";
+  }
+  return fd;
+}
+
+}  // namespace
+
+int run_daemon_client(const std::string& socketPath, std::string sessionId, const std::string& prompt) {
+  std::signal(SIGPIPE, SIG_IGN);
+  const int fd = connect_or_report(socketPath);
+  if (fd < 0) {
+    return 1;
+  }
+  std::string buffer;
+  int status = 0;
+  if (prompt == "/status") {
+    status = exchange(fd, buffer, {"status"}, sessionId) ? 0 : 1;
+  } else if (!prompt.empty()) {
+    status = exchange(fd, buffer, {"prompt", sessionId, prompt}, sessionId) ? 0 : 1;
+  } else {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+      if (line.empty()) {
+        continue;
+      }
+      if (line == "/exit" || line == "/quit") {
+        break;
+      }
+      const bool ok = line == "/status" ? exchange(fd, buffer, {"status"}, sessionId)
+                                        : exchange(fd, buffer, {"prompt", sessionId, line}, sessionId);
+      if (!ok) {
+        status = 1;
+        break;
+      }
+    }
+    if (!sessionId.empty()) {
+      std::cerr << "session: " << sessionId << "\n";
+    }
+  }
+  ::close(fd);
+  return status;
+}
+
+int stop_daemon(const std::string& socketPath) {
+  std::signal(SIGPIPE, SIG_IGN);
+  const int fd = connect_or_report(socketPath);
+  if (fd < 0) {
+    return 1;
+  }
+  std::string buffer;
+  std::string sessionId;
+  const bool ok = exchange(fd, buffer, {"shutdown"}, sessionId);
+  ::close(fd);
+  return ok ? 0 : 1;
+}
+
+}  // namespace sentra
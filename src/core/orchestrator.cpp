@@ -6,8 +6,26 @@
 #include <stdexcept>
 
 #include "sentra/context_window.hpp"
+#include "sentra/stop_sequences.hpp"
 
 namespace sentra {
+namespace {
+
+void append_warning(std::string& warning, const std::string& note) {
+  warning = warning.empty() ? note : warning + "; " + note;
+}
+
+std::vector<std::string> stop_sequences_for(const std::string& configured) {
+  if (configured.empty()) {
+    return transcript_stop_sequences();
+  }
+  if (configured == "none") {
+    return {};
+  }
+  return parse_stop_sequences(configured);
+}
+
+}  // namespace
 
 Orchestrator::Orchestrator(AppConfig config, ModelRegistry modelRegistry, AppState appState,
                            std::vector<std::unique_ptr<IModelRuntime>> runtimes)
@@ -15,7 +33,9 @@ Orchestrator::Orchestrator(AppConfig config, ModelRegistry modelRegistry, AppSta
       m_modelRegistry(std::move(modelRegistry)),
       m_appState(std::move(appState)),
       m_runtimes(std::move(runtimes)),
-      m_activeRuntimeIndex(pick_runtime_index(m_runtimeSelectionNote)) {}
+      m_activeRuntimeIndex(pick_runtime_index(m_runtimeSelectionNote)) {
+  apply_context_tokens();
+}
 
 std::string Orchestrator::active_runtime_name() const {
   if (!m_activeRuntimeIndex.has_value() || *m_activeRuntimeIndex >= m_runtimes.size()) {
@@ -75,6 +95,7 @@ bool Orchestrator::set_active_model(const std::string& modelId, std::string& err
   const bool ok = m_modelRegistry.set_active_model(modelId, error);
   if (ok) {
     m_appState.save_active_model_id(modelId);
+    preload_active_model();
   }
   return ok;
 }
@@ -107,10 +128,55 @@ std::size_t Orchestrator::max_tokens() const { return m_config.m_maxTokens; }
 
 std::size_t Orchestrator::context_window_tokens() const { return m_config.m_contextWindowTokens; }
 
-void Orchestrator::set_max_tokens(std::size_t value) { m_config.m_maxTokens = std::max<std::size_t>(1, value); }
+void Orchestrator::set_max_tokens(std::size_t value) {
+  m_config.m_maxTokens = std::max<std::size_t>(1, value);
+  apply_context_tokens();
+}
+
+std::size_t Orchestrator::max_latency_ms() const { return m_config.m_maxLatencyMs; }
+
+void Orchestrator::set_max_latency_ms(std::size_t value) { m_config.m_maxLatencyMs = value; }
 
 void Orchestrator::set_context_window_tokens(std::size_t value) {
   m_config.m_contextWindowTokens = std::max<std::size_t>(64, value);
+  apply_context_tokens();
+}
+
+std::string Orchestrator::context_prune_policy() const { return m_config.m_contextPrunePolicy; }
+
+bool Orchestrator::set_context_prune_policy(const std::string& policy, std::string& error) {
+  if (policy != "sliding" && policy != "hysteresis") {
+    error = "unknown prune policy: " + policy + " (use sliding|hysteresis)";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(*m_turnMutex);
+  m_config.m_contextPrunePolicy = policy;
+  m_pruneStates.clear();
+  error.clear();
+  return true;
+}
+
+double Orchestrator::context_low_water() const { return m_config.m_contextLowWater; }
+
+void Orchestrator::set_context_low_water(double ratio) { m_config.m_contextLowWater = std::clamp(ratio, 0.1, 0.95); }
+
+std::size_t Orchestrator::prefix_stable_turns() const {
+  std::lock_guard<std::mutex> lock(*m_turnMutex);
+  const auto it = m_pruneStates.find(m_sessionStatePath);
+  return it == m_pruneStates.end() ? 0 : it->second.m_prefixStableTurns;
+}
+
+std::string Orchestrator::speculative_mode() const {
+  std::string mode = m_config.m_llamaNgramDraft ? "ngram" : "";
+  if (!m_config.m_draftModelId.empty()) {
+    mode += (mode.empty() ? "draft=" : "+draft=") + m_config.m_draftModelId;
+  }
+  return mode.empty() ? "off" : mode;
+}
+
+PerfTotals Orchestrator::perf_totals() const {
+  std::lock_guard<std::mutex> lock(*m_turnMutex);
+  return m_perfTotals;
 }
 
 std::string Orchestrator::profile() const { return m_config.m_profile; }
@@ -130,21 +196,27 @@ bool Orchestrator::set_profile(const std::string& profile, std::string& error) {
   if (normalized == "fast") {
     m_config.m_profile = normalized;
     m_config.m_maxTokens = 128;
+    m_config.m_maxLatencyMs = AppConfig::kFastProfileLatencyMs;
     m_config.m_contextWindowTokens = 1024;
+    apply_context_tokens();
     error.clear();
     return true;
   }
   if (normalized == "balanced") {
     m_config.m_profile = normalized;
     m_config.m_maxTokens = 256;
+    m_config.m_maxLatencyMs = 0;
     m_config.m_contextWindowTokens = 2048;
+    apply_context_tokens();
     error.clear();
     return true;
   }
   if (normalized == "quality") {
     m_config.m_profile = normalized;
     m_config.m_maxTokens = 512;
+    m_config.m_maxLatencyMs = 0;
     m_config.m_contextWindowTokens = 4096;
+    apply_context_tokens();
     error.clear();
     return true;
   }
@@ -153,7 +225,102 @@ bool Orchestrator::set_profile(const std::string& profile, std::string& error) {
   return false;
 }
 
-GenerationResult Orchestrator::respond(const std::vector<Message>& history, StreamCallback on_token) {
+void Orchestrator::preload_active_model() {
+  const auto model = m_modelRegistry.active_model();
+  if (!m_activeRuntimeIndex.has_value() || *m_activeRuntimeIndex >= m_runtimes.size() || !model.has_value() ||
+      !std::filesystem::exists(model->get().m_localPath)) {
+    return;
+  }
+  m_runtimes[*m_activeRuntimeIndex]->preload(model->get().m_localPath);
+}
+
+std::string Orchestrator::tune_active_model(StreamCallback on_progress) {
+  if (!m_activeRuntimeIndex.has_value() || *m_activeRuntimeIndex >= m_runtimes.size()) {
+    throw std::runtime_error("no available runtime");
+  }
+  const auto model = m_modelRegistry.active_model();
+  if (!model.has_value()) {
+    throw std::runtime_error("no active model configured");
+  }
+  if (!std::filesystem::exists(model->get().m_localPath)) {
+    throw std::runtime_error("active model path is missing: " + model->get().m_localPath);
+  }
+  return m_runtimes[*m_activeRuntimeIndex]->tune(model->get().m_localPath, std::move(on_progress));
+}
+
+std::string Orchestrator::model_load_status() const {
+  if (!m_activeRuntimeIndex.has_value() || *m_activeRuntimeIndex >= m_runtimes.size()) {
+    return "n/a";
+  }
+  return m_runtimes[*m_activeRuntimeIndex]->load_status();
+}
+
+std::string Orchestrator::memory_plan() const {
+  if (!m_activeRuntimeIndex.has_value() || *m_activeRuntimeIndex >= m_runtimes.size()) {
+    return "";
+  }
+  return m_runtimes[*m_activeRuntimeIndex]->memory_plan();
+}
+
+std::vector<std::string> Orchestrator::resident_model_ids() const {
+  std::vector<std::string> ids;
+  if (!m_activeRuntimeIndex.has_value() || *m_activeRuntimeIndex >= m_runtimes.size()) {
+    return ids;
+  }
+  for (const auto& path : m_runtimes[*m_activeRuntimeIndex]->resident_models()) {
+    const auto it = std::find_if(m_modelRegistry.models().begin(), m_modelRegistry.models().end(),
+                                 [&](const ModelSpec& model) { return model.m_localPath == path; });
+    ids.push_back(it != m_modelRegistry.models().end() ? it->m_id : path);
+  }
+  return ids;
+}
+
+void Orchestrator::set_session_state_path(std::string path) { m_sessionStatePath = std::move(path); }
+
+void Orchestrator::save_session_state() {
+  if (m_config.m_sessionKvSnapshot == "off" || !m_activeRuntimeIndex.has_value() ||
+      *m_activeRuntimeIndex >= m_runtimes.size()) {
+    return;
+  }
+  m_runtimes[*m_activeRuntimeIndex]->save_session_state();
+}
+
+GenerationResult Orchestrator::respond(const std::vector<Message>& history, StreamCallback on_token,
+                                       PrefillProgressCallback on_prefill, const std::atomic<bool>* cancel) {
+  return respond_in_session(m_sessionStatePath, history, std::move(on_token), std::move(on_prefill), cancel);
+}
+
+GenerationResult Orchestrator::respond_in_session(const std::string& sessionStatePath,
+                                                  const std::vector<Message>& history, StreamCallback on_token,
+                                                  PrefillProgressCallback on_prefill,
+                                                  const std::atomic<bool>* cancel) {
+  return run_turn(sessionStatePath, history, std::move(on_token), std::move(on_prefill), cancel, false);
+}
+
+GenerationResult Orchestrator::continue_answer(const std::vector<Message>& history, StreamCallback on_token,
+                                               PrefillProgressCallback on_prefill, const std::atomic<bool>* cancel) {
+  if (history.empty() || history.back().m_role != Role::Assistant) {
+    throw std::runtime_error("no assistant answer to continue");
+  }
+  return run_turn(m_sessionStatePath, history, std::move(on_token), std::move(on_prefill), cancel, true);
+}
+
+GenerationResult Orchestrator::retry_answer(const std::vector<Message>& history, std::size_t samples,
+                                            StreamCallback on_token, PrefillProgressCallback on_prefill,
+                                            const std::atomic<bool>* cancel) {
+  if (history.empty() || history.back().m_role != Role::Assistant) {
+    throw std::runtime_error("no assistant answer to retry");
+  }
+  const std::vector<Message> prompt(history.begin(), history.end() - 1);
+  return run_turn(m_sessionStatePath, prompt, std::move(on_token), std::move(on_prefill), cancel, false,
+                  std::max<std::size_t>(1, samples));
+}
+
+GenerationResult Orchestrator::run_turn(const std::string& sessionStatePath, const std::vector<Message>& history,
+                                        StreamCallback on_token, PrefillProgressCallback on_prefill,
+                                        const std::atomic<bool>* cancel, bool continueLast,
+                                        std::size_t retrySamples) {
+  const std::size_t samples = std::max<std::size_t>(1, retrySamples);
   if (!m_activeRuntimeIndex.has_value() || *m_activeRuntimeIndex >= m_runtimes.size()) {
     throw std::runtime_error("no available runtime");
   }
@@ -162,34 +329,145 @@ GenerationResult Orchestrator::respond(const std::vector<Message>& history, Stre
   if (!model.has_value()) {
     throw std::runtime_error("no active model configured");
   }
-  const ModelSpec& active = model->get();
-  if (!std::filesystem::exists(active.m_localPath)) {
-    throw std::runtime_error("active model path is missing: " + active.m_localPath +
-                             " (run /model validate or /model download " + active.m_id + ")");
+  const ModelSpec& selected = model->get();
+  if (!std::filesystem::exists(selected.m_localPath)) {
+    throw std::runtime_error("active model path is missing: " + selected.m_localPath +
+                             " (run /model validate or /model download " + selected.m_id + ")");
   }
-  std::ifstream in(active.m_localPath);
+  std::ifstream in(selected.m_localPath);
   if (!in.good()) {
-    throw std::runtime_error("active model path is not readable: " + active.m_localPath);
+    throw std::runtime_error("active model path is not readable: " + selected.m_localPath);
   }
 
+  // While a newly selected model loads in the background, keep answering
+  // with the model that served the previous turn instead of blocking.
+  IModelRuntime& runtime = *m_runtimes[*m_activeRuntimeIndex];
+  std::string switchNote;
+  std::string servingId;
+  {
+    std::lock_guard<std::mutex> lock(*m_turnMutex);
+    servingId = m_servingModelId;
+  }
+  const ModelSpec* serving = &selected;
+  if (!servingId.empty() && servingId != selected.m_id && !runtime.is_model_ready(selected.m_localPath)) {
+    const auto previous = m_modelRegistry.find_model(servingId);
+    if (previous.has_value() && runtime.is_model_ready(previous->get().m_localPath)) {
+      serving = &previous->get();
+      switchNote = "model " + selected.m_id + " not ready (" + runtime.load_status() + "); answered with " + servingId;
+    }
+  }
+  const ModelSpec& active = *serving;
+
   GenerationRequest req;
   const std::size_t promptBudget =
       m_config.m_contextWindowTokens > m_config.m_maxTokens ? m_config.m_contextWindowTokens - m_config.m_maxTokens : 0;
-  const ContextPruneResult pruned = prune_context_window(history, promptBudget);
+  ContextPruneResult pruned;
+  {
+    std::lock_guard<std::mutex> lock(*m_turnMutex);
+    PruneState& state = m_pruneStates[sessionStatePath];
+    if (m_config.m_contextPrunePolicy == "hysteresis") {
+      const double lowWater = std::clamp(m_config.m_contextLowWater, 0.1, 0.95);
+      pruned = prune_context_window_stable(history, promptBudget,
+                                           static_cast<std::size_t>(static_cast<double>(promptBudget) * lowWater),
+                                           state.m_pruneCut);
+    } else {
+      pruned = prune_context_window(history, promptBudget);
+    }
+    // History is append-only, so the prompt prefix is unchanged exactly when
+    // the same number of old messages was dropped as on the previous turn.
+    // A retry answers a history one message shorter and leaves the state
+    // for the turn that follows it.
+    if (retrySamples == 0) {
+      if (m_config.m_contextPrunePolicy == "hysteresis") {
+        state.m_pruneCut = pruned.m_firstKeptIndex;
+      }
+      const std::size_t prunedMessages = history.size() - pruned.m_messages.size();
+      state.m_prefixStableTurns = prunedMessages == state.m_prunedMessages ? state.m_prefixStableTurns + 1 : 0;
+      state.m_prunedMessages = prunedMessages;
+    }
+  }
   req.m_messages = pruned.m_messages;
   req.m_modelId = active.m_id;
   req.m_modelPath = active.m_localPath;
   req.m_maxTokens = m_config.m_maxTokens;
-
-  GenerationResult result = m_runtimes[*m_activeRuntimeIndex]->generate(req, std::move(on_token));
+  req.m_stopSequences = stop_sequences_for(m_config.m_stopSequences);
+  req.m_repeatWindow = m_config.m_repeatWindow;
+  req.m_repeatThreshold = m_config.m_repeatThreshold;
+  req.m_repeatMinTokens = m_config.m_repeatMinTokens;
+  req.m_maxLatencyMs = m_config.m_maxLatencyMs;
+  if (m_config.m_sessionKvSnapshot != "off") {
+    req.m_sessionStatePath = sessionStatePath;
+  }
+  std::string draftNote;
+  if (!m_config.m_draftModelId.empty() && m_config.m_draftModelId != active.m_id) {
+    const auto draft = m_modelRegistry.find_model(m_config.m_draftModelId);
+    if (!draft.has_value()) {
+      draftNote = "unknown draft model id: " + m_config.m_draftModelId;
+    } else if (!std::filesystem::exists(draft->get().m_localPath)) {
+      draftNote = "draft model file not found: " + draft->get().m_localPath;
+    } else {
+      req.m_draftModelPath = draft->get().m_localPath;
+    }
+  }
+  req.m_onPrefillProgress = std::move(on_prefill);
+  req.m_cancel = cancel;
+  req.m_continueLast = continueLast;
+  req.m_samples = samples;
+
+  GenerationResult result = runtime.generate(req, std::move(on_token));
+  if (m_config.m_sessionKvSnapshot == "turn") {
+    runtime.save_session_state();
+  }
+  if (!draftNote.empty()) {
+    append_warning(result.m_warning, draftNote);
+  }
+  if (!switchNote.empty()) {
+    append_warning(result.m_warning, switchNote);
+  }
+  if (result.m_stopReason == "repetition") {
+    append_warning(result.m_warning, "answer was repeating itself; stopped early (saved " +
+                                         std::to_string(result.m_repetitionSavedTokens) + " tokens)");
+  }
+  if (result.m_stopReason == "time_budget") {
+    append_warning(result.m_warning, "time budget of " + std::to_string(m_config.m_maxLatencyMs) +
+                                         " ms reached; answer cut short");
+  }
+  if (samples > 1 && !result.m_cancelled && result.m_alternatives.size() + 1 < samples) {
+    append_warning(result.m_warning, "runtime produced " + std::to_string(result.m_alternatives.size() + 1) + " of " +
+                                         std::to_string(samples) + " answers");
+  }
+  if (result.m_cancelled) {
+    append_warning(result.m_warning, "generation cancelled; partial answer kept (" +
+                                         std::to_string(result.m_generatedTokens) + " tokens)");
+  }
   if (pruned.m_truncated) {
     result.m_contextTruncated = true;
-    result.m_warning = "context truncated to fit token budget (kept approx " +
-                      std::to_string(pruned.m_tokensKept) + " tokens)";
+    append_warning(result.m_warning, "context truncated to fit token budget (kept approx " +
+                                         std::to_string(pruned.m_tokensKept) + " tokens)");
+  }
+  std::lock_guard<std::mutex> lock(*m_turnMutex);
+  m_servingModelId = active.m_id;
+  ++m_perfTotals.m_turns;
+  m_perfTotals.m_generatedTokens += result.m_generatedTokens;
+  m_perfTotals.m_totalMs += result.m_totalMs;
+  m_perfTotals.m_draftedTokens += result.m_draftedTokens;
+  m_perfTotals.m_acceptedDraftTokens += result.m_acceptedDraftTokens;
+  if (result.m_stopReason == "repetition") {
+    ++m_perfTotals.m_repetitionStops;
+    m_perfTotals.m_repetitionSavedTokens += result.m_repetitionSavedTokens;
   }
   return result;
 }
 
+// The prompt is pruned to context_window_tokens - max_tokens by an estimate,
+// so the runtime sizes its context for the whole window plus one more reply.
+void Orchestrator::apply_context_tokens() {
+  if (!m_activeRuntimeIndex.has_value() || *m_activeRuntimeIndex >= m_runtimes.size()) {
+    return;
+  }
+  m_runtimes[*m_activeRuntimeIndex]->set_context_tokens(m_config.m_contextWindowTokens + m_config.m_maxTokens);
+}
+
 std::optional<std::size_t> Orchestrator::pick_runtime_index(std::string& note) const {
   if (m_runtimes.empty()) {
     note = "no runtimes configured";
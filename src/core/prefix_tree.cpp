@@ -0,0 +1,157 @@
+#include "sentra/prefix_tree.hpp"
+
+namespace sentra {
+
+PrefixTree::PrefixTree() : m_root(std::make_unique<Node>()) {}
+
+PrefixTree::Match PrefixTree::longest_match(const std::vector<std::int32_t>& tokens) {
+  const Node* node = m_root.get();
+  std::size_t pos = 0;
+  while (pos < tokens.size()) {
+    const auto it = node->m_children.find(tokens[pos]);
+    if (it == node->m_children.end()) {
+      break;
+    }
+    const Node* child = it->second.get();
+    std::size_t matched = 0;
+    while (matched < child->m_edge.size() && pos + matched < tokens.size() &&
+           child->m_edge[matched] == tokens[pos + matched]) {
+      ++matched;
+    }
+    pos += matched;
+    node = child;
+    if (matched < child->m_edge.size()) {
+      break;
+    }
+  }
+
+  Match match;
+  const Node* entry = most_recent_entry_below(node);
+  if (entry == nullptr || pos == 0) {
+    return match;
+  }
+  m_entries.at(entry->m_entry)->m_lastUsed = ++m_clock;
+  match.m_entry = entry->m_entry;
+  match.m_length = pos;
+  return match;
+}
+
+int PrefixTree::insert(const std::vector<std::int32_t>& tokens, int entry) {
+  Node* node = m_root.get();
+  std::size_t pos = 0;
+  while (pos < tokens.size()) {
+    auto it = node->m_children.find(tokens[pos]);
+    if (it == node->m_children.end()) {
+      auto leaf = std::make_unique<Node>();
+      leaf->m_edge.assign(tokens.begin() + static_cast<std::ptrdiff_t>(pos), tokens.end());
+      leaf->m_parent = node;
+      m_tokenCount += leaf->m_edge.size();
+      Node* raw = leaf.get();
+      node->m_children.emplace(tokens[pos], std::move(leaf));
+      node = raw;
+      pos = tokens.size();
+      break;
+    }
+    Node* child = it->second.get();
+    std::size_t matched = 0;
+    while (matched < child->m_edge.size() && pos + matched < tokens.size() &&
+           child->m_edge[matched] == tokens[pos + matched]) {
+      ++matched;
+    }
+    if (matched < child->m_edge.size()) {
+      // Split the edge so the new path can end or branch at the divergence.
+      auto mid = std::make_unique<Node>();
+      mid->m_edge.assign(child->m_edge.begin(), child->m_edge.begin() + static_cast<std::ptrdiff_t>(matched));
+      mid->m_parent = node;
+      std::unique_ptr<Node> tail = std::move(it->second);
+      tail->m_edge.erase(tail->m_edge.begin(), tail->m_edge.begin() + static_cast<std::ptrdiff_t>(matched));
+      tail->m_parent = mid.get();
+      const std::int32_t tailKey = tail->m_edge.front();
+      mid->m_children.emplace(tailKey, std::move(tail));
+      it->second = std::move(mid);
+      child = it->second.get();
+    }
+    pos += matched;
+    node = child;
+  }
+
+  const int replaced = node->m_entry;
+  if (replaced >= 0) {
+    m_entries.erase(replaced);
+  }
+  node->m_entry = entry;
+  node->m_lastUsed = ++m_clock;
+  m_entries[entry] = node;
+  return replaced;
+}
+
+void PrefixTree::erase(int entry) {
+  const auto it = m_entries.find(entry);
+  if (it == m_entries.end()) {
+    return;
+  }
+  Node* node = it->second;
+  m_entries.erase(it);
+  node->m_entry = -1;
+  prune(node);
+}
+
+void PrefixTree::clear() {
+  m_root = std::make_unique<Node>();
+  m_entries.clear();
+  m_tokenCount = 0;
+}
+
+int PrefixTree::least_recent_entry() const {
+  int oldest = -1;
+  std::uint64_t oldestUse = 0;
+  for (const auto& [entry, node] : m_entries) {
+    if (oldest < 0 || node->m_lastUsed < oldestUse) {
+      oldest = entry;
+      oldestUse = node->m_lastUsed;
+    }
+  }
+  return oldest;
+}
+
+std::size_t PrefixTree::entry_count() const { return m_entries.size(); }
+
+std::size_t PrefixTree::token_count() const { return m_tokenCount; }
+
+const PrefixTree::Node* PrefixTree::most_recent_entry_below(const Node* node) const {
+  const Node* best = node->m_entry >= 0 ? node : nullptr;
+  for (const auto& [key, child] : node->m_children) {
+    const Node* candidate = most_recent_entry_below(child.get());
+    if (candidate != nullptr && (best == nullptr || candidate->m_lastUsed > best->m_lastUsed)) {
+      best = candidate;
+    }
+  }
+  return best;
+}
+
+// Removes nodes no entry needs any more and re-merges single-child chains so
+// every inner node is either an entry or a branch point.
+void PrefixTree::prune(Node* node) {
+  while (node != m_root.get() && node->m_entry < 0 && node->m_children.empty()) {
+    Node* parent = node->m_parent;
+    m_tokenCount -= node->m_edge.size();
+    parent->m_children.erase(node->m_edge.front());
+    node = parent;
+  }
+  if (node != m_root.get() && node->m_entry < 0 && node->m_children.size() == 1) {
+    std::unique_ptr<Node> only = std::move(node->m_children.begin()->second);
+    node->m_children.clear();
+    node->m_edge.insert(node->m_edge.end(), only->m_edge.begin(), only->m_edge.end());
+    node->m_entry = only->m_entry;
+    node->m_lastUsed = only->m_lastUsed;
+    node->m_children = std::move(only->m_children);
+    for (auto& [key, child] : node->m_children) {
+      child->m_parent = node;
+    }
+    if (node->m_entry >= 0) {
+      m_entries[node->m_entry] = node;
+    }
+  }
+}
+
+}  // namespace sentra
@@ -0,0 +1,58 @@
+#include "sentra/repetition_detector.hpp"
+
+#include <algorithm>
+
+namespace sentra {
+namespace {
+
+constexpr std::uint64_t kHashBase = 0x100000001b3ULL;
+
+}  // namespace
+
+RepetitionDetector::RepetitionDetector(std::size_t maxPeriod, std::size_t minCopies, std::size_t minTokens)
+    : m_maxPeriod(maxPeriod), m_minCopies(std::max<std::size_t>(minCopies, 2)), m_minTokens(minTokens) {}
+
+bool RepetitionDetector::enabled() const { return m_maxPeriod > 0; }
+
+std::size_t RepetitionDetector::period() const { return m_period; }
+
+std::size_t RepetitionDetector::copies() const { return m_copies; }
+
+std::uint64_t RepetitionDetector::segment_hash(std::size_t begin, std::size_t end) const {
+  // Unsigned overflow wraps, so this is arithmetic modulo 2^64.
+  return m_prefixHash[end] - m_prefixHash[begin] * m_power[end - begin];
+}
+
+bool RepetitionDetector::push(std::int32_t token) {
+  if (!enabled()) {
+    return false;
+  }
+  m_tokens.push_back(token);
+  m_prefixHash.push_back(m_prefixHash.back() * kHashBase + static_cast<std::uint32_t>(token) + 1);
+  m_power.push_back(m_power.back() * kHashBase);
+
+  const std::size_t n = m_tokens.size();
+  for (std::size_t period = 1; period <= m_maxPeriod; ++period) {
+    const std::size_t copies = std::max(m_minCopies, (m_minTokens + period - 1) / period);
+    const std::size_t span = period * copies;
+    if (span > n) {
+      continue;
+    }
+    // A run of `copies` blocks of length `period` is exactly a span that
+    // equals itself shifted by one block.
+    const std::size_t begin = n - span;
+    if (segment_hash(begin, n - period) != segment_hash(begin + period, n)) {
+      continue;
+    }
+    if (std::equal(m_tokens.begin() + static_cast<std::ptrdiff_t>(begin),
+                   m_tokens.end() - static_cast<std::ptrdiff_t>(period),
+                   m_tokens.begin() + static_cast<std::ptrdiff_t>(begin + period))) {
+      m_period = period;
+      m_copies = copies;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace sentra
@@ -32,6 +32,27 @@ Role role_from_string(const std::string& value) {
   return Role::User;
 }
 
+void extend_message(Message& message, const Message& continuation) {
+  message.m_content += continuation.m_content;
+  if (!message.m_tokens.empty() && message.m_tokensModel == continuation.m_tokensModel) {
+    message.m_tokens.insert(message.m_tokens.end(), continuation.m_tokens.begin(), continuation.m_tokens.end());
+  } else {
+    message.m_tokens.clear();
+    message.m_tokensModel.clear();
+  }
+}
+
+bool record_answer(const SessionStore& store, const std::string& sessionId, std::vector<Message>& history,
+                   const GenerationResult& result) {
+  if (result.m_text.empty()) {
+    return false;
+  }
+  Message assistantMsg{Role::Assistant, result.m_text, result.m_tokens, result.m_tokensModel};
+  store.append(sessionId, assistantMsg);
+  history.push_back(std::move(assistantMsg));
+  return true;
+}
+
 SessionStore::SessionStore(std::string baseDir) : m_baseDir(std::move(baseDir)) {
   std::filesystem::create_directories(m_baseDir);
 }
@@ -62,8 +83,29 @@ std::vector<Message> SessionStore::load(const std::string& sessionId) const {
       messages.push_back({role_from_string(cols[0]), unescape(cols[1])});
       continue;
     }
-    if (cols.size() >= 4 && cols[0] == "v1" && cols[1] == "msg") {
-      messages.push_back({role_from_string(cols[2]), unescape(cols[3])});
+    if (cols.size() >= 4 && cols[0] == "v1" && (cols[1] == "msg" || cols[1] == "cont" || cols[1] == "redo")) {
+      Message message{role_from_string(cols[2]), unescape(cols[3])};
+      if (cols.size() >= 6 && !cols[4].empty()) {
+        std::istringstream ids(cols[5]);
+        std::int32_t id = 0;
+        while (ids >> id) {
+          message.m_tokens.push_back(id);
+        }
+        if (!message.m_tokens.empty()) {
+          message.m_tokensModel = unescape(cols[4]);
+        }
+      }
+      if (cols[1] == "cont") {
+        if (!messages.empty()) {
+          extend_message(messages.back(), message);
+        }
+        continue;
+      }
+      if (cols[1] == "redo" && !messages.empty()) {
+        messages.back() = std::move(message);
+        continue;
+      }
+      messages.push_back(std::move(message));
       continue;
     }
   }
@@ -72,11 +114,30 @@ std::vector<Message> SessionStore::load(const std::string& sessionId) const {
 }
 
 void SessionStore::append(const std::string& sessionId, const Message& message) const {
+  write_record(sessionId, "msg", message);
+}
+
+void SessionStore::append_continuation(const std::string& sessionId, const Message& continuation) const {
+  write_record(sessionId, "cont", continuation);
+}
+
+void SessionStore::replace_last(const std::string& sessionId, const Message& message) const {
+  write_record(sessionId, "redo", message);
+}
+
+void SessionStore::write_record(const std::string& sessionId, const std::string& kind, const Message& message) const {
   std::ofstream out(path_for(sessionId), std::ios::app);
   if (!out.is_open()) {
     throw std::runtime_error("failed to open session file for append");
   }
-  out << "v1\tmsg\t" << role_to_string(message.m_role) << '\t' << escape(message.m_content) << '\n';
+  out << "v1\t" << kind << '\t' << role_to_string(message.m_role) << '\t' << escape(message.m_content);
+  if (!message.m_tokens.empty() && !message.m_tokensModel.empty()) {
+    out << '\t' << escape(message.m_tokensModel) << '\t';
+    for (std::size_t i = 0; i < message.m_tokens.size(); ++i) {
+      out << (i == 0 ? "" : " ") << message.m_tokens[i];
+    }
+  }
+  out << '\n';
 }
 
 void SessionStore::ensure_session(const std::string& sessionId, const std::string& activeModelId,
@@ -185,6 +246,10 @@ std::string SessionStore::metadata_path_for(const std::string& sessionId) const
   return m_baseDir + "/" + sessionId + ".meta";
 }
 
+std::string SessionStore::kv_snapshot_path_for(const std::string& sessionId) const {
+  return m_baseDir + "/" + sessionId + ".kv";
+}
+
 std::string SessionStore::escape(const std::string& input) {
   std::string out;
   out.reserve(input.size());
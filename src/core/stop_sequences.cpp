@@ -0,0 +1,109 @@
+#include "sentra/stop_sequences.hpp"
+
+#include <algorithm>
+
+#include "sentra/types.hpp"
+
+namespace sentra {
+
+std::vector<std::string> transcript_stop_sequences() {
+  std::vector<std::string> sequences;
+  for (const Role role : {Role::User, Role::System, Role::Assistant}) {
+    sequences.push_back("\n" + role_to_string(role) + ":");
+  }
+  return sequences;
+}
+
+std::vector<std::string> parse_stop_sequences(const std::string& value) {
+  std::vector<std::string> sequences;
+  std::string current;
+  for (std::size_t i = 0; i < value.size(); ++i) {
+    const char c = value[i];
+    if (c == '\\' && i + 1 < value.size()) {
+      const char next = value[++i];
+      current.push_back(next == 'n' ? '\n' : (next == 't' ? '\t' : next));
+    } else if (c == '|') {
+      if (!current.empty()) {
+        sequences.push_back(current);
+      }
+      current.clear();
+    } else {
+      current.push_back(c);
+    }
+  }
+  if (!current.empty()) {
+    sequences.push_back(current);
+  }
+  return sequences;
+}
+
+StopSequenceMatcher::StopSequenceMatcher(std::vector<std::string> sequences) : m_sequences(std::move(sequences)) {
+  m_sequences.erase(std::remove(m_sequences.begin(), m_sequences.end(), std::string()), m_sequences.end());
+  for (const auto& sequence : m_sequences) {
+    m_longest = std::max(m_longest, sequence.size());
+  }
+}
+
+std::string StopSequenceMatcher::feed(const std::string& text) {
+  if (m_hasMatch) {
+    return "";
+  }
+  m_text += text;
+  if (m_sequences.empty()) {
+    m_released = m_text.size();
+    return text;
+  }
+
+  // Only positions that were still held back can start a new match.
+  std::size_t earliest = std::string::npos;
+  for (const auto& sequence : m_sequences) {
+    const std::size_t pos = m_text.find(sequence, m_scanFrom);
+    if (pos < earliest) {
+      earliest = pos;
+      m_matched = sequence;
+    }
+  }
+  if (earliest != std::string::npos) {
+    m_hasMatch = true;
+    m_matchOffset = earliest;
+    std::string out = m_text.substr(m_released, earliest - m_released);
+    m_released = earliest;
+    return out;
+  }
+
+  // Hold back the longest tail that is a proper prefix of some sequence.
+  std::size_t hold = 0;
+  const std::size_t maxHold = std::min(m_text.size(), m_longest - 1);
+  for (std::size_t len = maxHold; len > 0 && hold == 0; --len) {
+    const std::size_t start = m_text.size() - len;
+    for (const auto& sequence : m_sequences) {
+      if (sequence.size() > len && m_text.compare(start, len, sequence, 0, len) == 0) {
+        hold = len;
+        break;
+      }
+    }
+  }
+  const std::size_t safe = std::max(m_released, m_text.size() - hold);
+  std::string out = m_text.substr(m_released, safe - m_released);
+  m_released = safe;
+  m_scanFrom = safe;
+  return out;
+}
+
+std::string StopSequenceMatcher::flush() {
+  if (m_hasMatch) {
+    return "";
+  }
+  std::string out = m_text.substr(m_released);
+  m_released = m_text.size();
+  m_scanFrom = m_text.size();
+  return out;
+}
+
+bool StopSequenceMatcher::matched() const { return m_hasMatch; }
+
+std::size_t StopSequenceMatcher::match_offset() const { return m_matchOffset; }
+
+const std::string& StopSequenceMatcher::matched_sequence() const { return m_matched; }
+
+}  // namespace sentra
@@ -8,6 +8,7 @@
 
 #include "sentra/config.hpp"
 #include "sentra/app_state.hpp"
+#include "sentra/daemon.hpp"
 #include "sentra/model_registry.hpp"
 #include "sentra/orchestrator.hpp"
 #include "sentra/repl.hpp"
@@ -36,6 +37,7 @@ AppConfig AppConfig::load_from_file(const std::string& path) {
     return config;
   }
 
+  bool latencySet = false;
   std::string line;
   while (std::getline(in, line)) {
     line = trim(line);
@@ -67,22 +69,82 @@ AppConfig AppConfig::load_from_file(const std::string& path) {
       config.m_localCommandTemplate = value;
     } else if (key == "max_tokens") {
       config.m_maxTokens = static_cast<std::size_t>(std::stoul(value));
+    } else if (key == "max_latency_ms") {
+      config.m_maxLatencyMs = static_cast<std::size_t>(std::stoul(value));
+      latencySet = true;
     } else if (key == "context_window_tokens") {
       config.m_contextWindowTokens = static_cast<std::size_t>(std::stoul(value));
+    } else if (key == "stop_sequences") {
+      config.m_stopSequences = value;
+    } else if (key == "repeat_window") {
+      config.m_repeatWindow = static_cast<std::size_t>(std::stoul(value));
+    } else if (key == "repeat_threshold") {
+      config.m_repeatThreshold = static_cast<std::size_t>(std::stoul(value));
+    } else if (key == "repeat_min_tokens") {
+      config.m_repeatMinTokens = static_cast<std::size_t>(std::stoul(value));
+    } else if (key == "context_prune_policy") {
+      config.m_contextPrunePolicy = value;
+    } else if (key == "context_low_water") {
+      config.m_contextLowWater = std::stod(value);
     } else if (key == "llama_n_threads") {
       config.m_llamaNThreads = std::stoi(value);
     } else if (key == "llama_n_threads_batch") {
       config.m_llamaNThreadsBatch = std::stoi(value);
     } else if (key == "llama_n_batch") {
       config.m_llamaNBatch = std::stoi(value);
+    } else if (key == "llama_n_ubatch") {
+      config.m_llamaNUbatch = std::stoi(value);
     } else if (key == "llama_offload_kqv") {
       config.m_llamaOffloadKqv = (value == "1" || value == "true" || value == "yes");
     } else if (key == "llama_op_offload") {
       config.m_llamaOpOffload = (value == "1" || value == "true" || value == "yes");
+    } else if (key == "llama_kv_type") {
+      config.m_llamaKvType = value;
+    } else if (key == "llama_flash_attn") {
+      config.m_llamaFlashAttn = value;
+    } else if (key == "draft_model_id") {
+      config.m_draftModelId = value;
+    } else if (key == "llama_draft_max") {
+      config.m_llamaDraftMax = std::stoi(value);
+    } else if (key == "llama_draft_p_min") {
+      config.m_llamaDraftPMin = std::stof(value);
+    } else if (key == "llama_ngram_draft") {
+      config.m_llamaNgramDraft = (value == "1" || value == "true" || value == "yes");
+    } else if (key == "llama_ngram_min") {
+      config.m_llamaNgramMin = std::stoi(value);
+    } else if (key == "llama_ngram_max") {
+      config.m_llamaNgramMax = std::stoi(value);
+    } else if (key == "llama_parallel") {
+      config.m_llamaParallel = std::stoi(value);
+    } else if (key == "llama_prefix_cache_entries") {
+      config.m_llamaPrefixCacheEntries = std::stoi(value);
+    } else if (key == "llama_prefix_cache_mb") {
+      config.m_llamaPrefixCacheMb = std::stoi(value);
+    } else if (key == "prompt_cache_dir") {
+      config.m_promptCacheDir = value;
+    } else if (key == "tune_dir") {
+      config.m_tuneDir = value;
+    } else if (key == "llama_cpu_set") {
+      config.m_llamaCpuSet = value;
+    } else if (key == "llama_numa_node") {
+      config.m_llamaNumaNode = value.empty() ? -1 : std::stoi(value);
+    } else if (key == "llama_numa") {
+      config.m_llamaNuma = value;
+    } else if (key == "keep_previous_model") {
+      config.m_keepPreviousModel = (value == "1" || value == "true" || value == "yes");
+    } else if (key == "llama_resident_mb") {
+      config.m_llamaResidentMb = std::stoi(value);
+    } else if (key == "daemon_socket") {
+      config.m_daemonSocket = value;
     } else if (key == "profile") {
       config.m_profile = value;
+    } else if (key == "session_kv_snapshot") {
+      config.m_sessionKvSnapshot = value;
     }
   }
+  if (!latencySet && config.m_profile == "fast") {
+    config.m_maxLatencyMs = AppConfig::kFastProfileLatencyMs;
+  }
 
   return config;
 }
@@ -93,6 +155,9 @@ int main(int argc, char** argv) {
   try {
     std::string configPath = "sentra.conf";
     std::string sessionId;
+    std::string socketPath;
+    std::string mode = "repl";
+    std::string clientPrompt;
 
     for (int i = 1; i < argc; ++i) {
       const std::string arg = argv[i];
@@ -100,10 +165,31 @@ int main(int argc, char** argv) {
         configPath = argv[++i];
       } else if (arg == "--session" && i + 1 < argc) {
         sessionId = argv[++i];
+      } else if (arg == "--socket" && i + 1 < argc) {
+        socketPath = argv[++i];
+      } else if (arg == "--daemon") {
+        mode = "daemon";
+      } else if (arg == "--daemon-stop") {
+        mode = "daemon-stop";
+      } else if (arg == "--client") {
+        mode = "client";
+      } else if (arg == "tune" && mode == "repl") {
+        mode = "tune";
+      } else if (mode == "client") {
+        clientPrompt += (clientPrompt.empty() ? "" : " ") + arg;
       }
     }
 
     sentra::AppConfig config = sentra::AppConfig::load_from_file(configPath);
+    if (socketPath.empty()) {
+      socketPath = config.m_daemonSocket;
+    }
+    if (mode == "client") {
+      return sentra::run_daemon_client(socketPath, sessionId, clientPrompt);
+    }
+    if (mode == "daemon-stop") {
+      return sentra::stop_daemon(socketPath);
+    }
     sentra::SessionStore sessionStore(config.m_sessionsDir);
     sentra::AppState appState(config.m_stateFile);
     const std::string persistedModelId = appState.load_active_model_id();
@@ -121,13 +207,47 @@ int main(int argc, char** argv) {
     llamaOptions.m_nThreads = config.m_llamaNThreads;
     llamaOptions.m_nThreadsBatch = config.m_llamaNThreadsBatch;
     llamaOptions.m_nBatch = config.m_llamaNBatch;
+    llamaOptions.m_nUbatch = config.m_llamaNUbatch;
+    llamaOptions.m_nParallel = config.m_llamaParallel;
+    llamaOptions.m_prefixCacheEntries = config.m_llamaPrefixCacheEntries;
+    llamaOptions.m_prefixCacheMb = config.m_llamaPrefixCacheMb;
+    llamaOptions.m_promptCacheDir = config.m_promptCacheDir;
+    llamaOptions.m_tuneDir = config.m_tuneDir;
+    llamaOptions.m_cpuSet = config.m_llamaCpuSet;
+    llamaOptions.m_numaNode = config.m_llamaNumaNode;
+    llamaOptions.m_numa = config.m_llamaNuma;
+    llamaOptions.m_keepPreviousModel = config.m_keepPreviousModel;
+    llamaOptions.m_residentMb = config.m_llamaResidentMb;
     llamaOptions.m_offloadKqv = config.m_llamaOffloadKqv;
     llamaOptions.m_opOffload = config.m_llamaOpOffload;
+    llamaOptions.m_kvCacheType = config.m_llamaKvType;
+    llamaOptions.m_flashAttn = config.m_llamaFlashAttn;
+    llamaOptions.m_draftMax = config.m_llamaDraftMax;
+    llamaOptions.m_draftPMin = config.m_llamaDraftPMin;
+    llamaOptions.m_ngramDraft = config.m_llamaNgramDraft;
+    llamaOptions.m_ngramMin = config.m_llamaNgramMin;
+    llamaOptions.m_ngramMax = config.m_llamaNgramMax;
     llamaOptions.m_profile = config.m_profile;
     runtimes.push_back(sentra::make_llama_inproc_runtime(llamaOptions));
     runtimes.push_back(sentra::make_local_binary_runtime(config.m_localCommandTemplate));
     runtimes.push_back(sentra::make_mock_runtime());
 
+    if (mode == "tune") {
+      sentra::Orchestrator orchestrator(config, std::move(modelRegistry), std::move(appState), std::move(runtimes));
+      const std::string path =
+          orchestrator.tune_active_model([](const std::string& line) { std::cout << line << std::flush; });
+      std::cout << "saved: " << path << "\n";
+      return 0;
+    }
+
+    if (mode == "daemon") {
+      sentra::Daemon daemon(
+          socketPath, std::move(sessionStore),
+          sentra::Orchestrator(config, std::move(modelRegistry), std::move(appState), std::move(runtimes)),
+          config.m_systemPrompt);
+      return daemon.run();
+    }
+
     sentra::Repl repl(
         sessionId, std::move(sessionStore),
         sentra::Orchestrator(config, std::move(modelRegistry), std::move(appState), std::move(runtimes)),
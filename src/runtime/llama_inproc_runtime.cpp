@@ -1,28 +1,43 @@
 #include "sentra/runtime.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
 #include <mutex>
-#include <sstream>
+#include <set>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "sentra/context_window.hpp"
+#include "sentra/prefix_tree.hpp"
+#include "sentra/repetition_detector.hpp"
+#include "sentra/stop_sequences.hpp"
+
 #if defined(SENTRA_HAS_LLAMA_CPP)
 #include <llama.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
 #endif
 
 namespace sentra {
 namespace {
 
-std::string render_prompt(const GenerationRequest& request) {
-  std::ostringstream prompt;
-  for (const auto& message : request.m_messages) {
-    prompt << role_to_string(message.m_role) << ": " << message.m_content << "\n";
-  }
-  prompt << "assistant: ";
-  return prompt.str();
-}
-
 std::string normalize_profile(std::string profile) {
   for (char& c : profile) {
     if (c >= 'A' && c <= 'Z') {
@@ -36,6 +51,45 @@ std::string normalize_profile(std::string profile) {
 }
 
 #if defined(SENTRA_HAS_LLAMA_CPP)
+// An empty llama_kv_type takes the profile default: fast halves KV memory
+// with q8_0, the others keep f16. Unknown names fall back to f16.
+std::string normalize_kv_type(const std::string& type, const std::string& profile) {
+  if (type.empty()) {
+    return profile == "fast" ? "q8_0" : "f16";
+  }
+  if (type != "q8_0" && type != "q4_0") {
+    return "f16";
+  }
+  return type;
+}
+
+// llama.cpp only supports a quantized V cache with flash attention, so a
+// quantized KV type turns it on; otherwise fast defaults to on and the
+// others let llama decide.
+std::string normalize_flash_attn(const std::string& mode, const std::string& kvType, const std::string& profile) {
+  if (kvType != "f16") {
+    return "on";
+  }
+  if (mode == "on" || mode == "off" || mode == "auto") {
+    return mode;
+  }
+  return profile == "fast" ? "on" : "auto";
+}
+
+// Prompts that fit in one ubatch go out in a single decode. Longer prompts are
+// split into ubatch-aligned chunks (capped at n_batch) sized so that progress is
+// reported roughly every eighth of the prompt.
+std::size_t pick_prefill_chunk(std::size_t total, std::size_t nBatch, std::size_t nUbatch) {
+  nBatch = std::max<std::size_t>(1, nBatch);
+  nUbatch = std::clamp<std::size_t>(nUbatch, 1, nBatch);
+  if (total <= nUbatch) {
+    return total;
+  }
+  const std::size_t target = (total + 7) / 8;
+  const std::size_t aligned = ((target + nUbatch - 1) / nUbatch) * nUbatch;
+  return std::clamp(aligned, nUbatch, nBatch);
+}
+
 void llama_silent_log_callback(enum ggml_log_level, const char*, void*) {}
 
 struct ModelDeleter {
@@ -54,226 +108,2358 @@ struct ContextDeleter {
   }
 };
 
+struct SamplerDeleter {
+  void operator()(llama_sampler* sampler) const {
+    if (sampler != nullptr) {
+      llama_sampler_free(sampler);
+    }
+  }
+};
+
+struct BatchDeleter {
+  void operator()(llama_batch* batch) const {
+    if (batch != nullptr) {
+      llama_batch_free(*batch);
+      delete batch;
+    }
+  }
+};
+
+// ggml_threadpool_free lives in the CPU backend, which may be a dynamically
+// loaded module, so the deleter carries the resolved function.
+struct ThreadpoolDeleter {
+  void (*m_free)(ggml_threadpool*){nullptr};
+  void operator()(ggml_threadpool* pool) const {
+    if (pool != nullptr && m_free != nullptr) {
+      m_free(pool);
+    }
+  }
+};
+
+using ThreadpoolPtr = std::unique_ptr<ggml_threadpool, ThreadpoolDeleter>;
+
+// Parses a Linux cpulist such as "0-7,16-23".
+std::vector<int> parse_cpu_list(const std::string& text) {
+  std::vector<int> cpus;
+  std::size_t pos = 0;
+  while (pos < text.size()) {
+    std::size_t end = text.find(',', pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    const std::string range = text.substr(pos, end - pos);
+    const auto dash = range.find('-');
+    try {
+      const int first = std::stoi(range.substr(0, dash));
+      const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    } catch (const std::exception&) {
+      // Blank or malformed entries are skipped.
+    }
+    pos = end + 1;
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return cpus;
+}
+
+std::vector<int> numa_node_cpus(int node) {
+  std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+  std::string list;
+  std::getline(in, list);
+  return parse_cpu_list(list);
+}
+
+// Restricts the calling thread to cpus for its lifetime. Threads it spawns
+// inherit the mask, and pages it first touches are allocated on the node of
+// those CPUs.
+class ScopedAffinity {
+ public:
+  explicit ScopedAffinity(const std::vector<int>& cpus) {
+#if defined(__linux__)
+    if (cpus.empty() || sched_getaffinity(0, sizeof(m_saved), &m_saved) != 0) {
+      return;
+    }
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    for (const int cpu : cpus) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &pinned);
+      }
+    }
+    m_active = sched_setaffinity(0, sizeof(pinned), &pinned) == 0;
+#else
+    (void)cpus;
+#endif
+  }
+  ~ScopedAffinity() {
+#if defined(__linux__)
+    if (m_active) {
+      sched_setaffinity(0, sizeof(m_saved), &m_saved);
+    }
+#endif
+  }
+  ScopedAffinity(const ScopedAffinity&) = delete;
+  ScopedAffinity& operator=(const ScopedAffinity&) = delete;
+
+ private:
+#if defined(__linux__)
+  cpu_set_t m_saved{};
+#endif
+  bool m_active{false};
+};
+
+std::unique_ptr<llama_batch, BatchDeleter> make_batch(std::size_t capacity) {
+  return std::unique_ptr<llama_batch, BatchDeleter>(
+      new llama_batch(llama_batch_init(static_cast<int32_t>(capacity), 0, 1)));
+}
+
+std::uint64_t fnv1a(const void* data, std::size_t size, std::uint64_t hash = 14695981039346656037ull) {
+  const auto* bytes = static_cast<const unsigned char*>(data);
+  for (std::size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+std::string to_hex(std::uint64_t value) {
+  char buffer[17];
+  std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(value));
+  return buffer;
+}
+
+// One per load, shared with llama's load progress callback; setting m_cancel
+// aborts that load.
+struct LoadProgress {
+  std::atomic<float> m_fraction{0.0f};
+  std::atomic<bool> m_cancel{false};
+};
+
+// Model dimensions the memory planner needs, read once after the weights load.
+struct ModelShape {
+  std::size_t m_kvBytesPerToken{0};
+  std::size_t m_nHead{1};
+  std::size_t m_nVocab{0};
+  uint32_t m_nCtxTrain{0};
+};
+
+// Threads and batch size a model runs with; 0 leaves the choice to llama
+// (or 512 for n_batch).
+struct ThreadSettings {
+  int m_nThreads{0};
+  int m_nThreadsBatch{0};
+  int m_nBatch{0};
+};
+
+// Distinct (physical id, core id) pairs in /proc/cpuinfo; SMT siblings share
+// a pair. Falls back to the logical CPU count where that file is missing.
+int physical_core_count() {
+  std::ifstream in("/proc/cpuinfo");
+  std::set<std::pair<std::string, std::string>> cores;
+  std::string line;
+  std::string physicalId;
+  while (std::getline(in, line)) {
+    const auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    const std::string key = line.substr(0, line.find_last_not_of(" \t", colon - 1) + 1);
+    const std::string value = colon + 2 <= line.size() ? line.substr(colon + 2) : "";
+    if (key == "physical id") {
+      physicalId = value;
+    } else if (key == "core id") {
+      cores.emplace(physicalId, value);
+    }
+  }
+  if (!cores.empty()) {
+    return static_cast<int>(cores.size());
+  }
+  return static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+}
+
+// Tuned settings are only valid on the machine that measured them.
+std::string host_key() {
+  char name[256] = {};
+  if (gethostname(name, sizeof(name) - 1) != 0 || name[0] == '\0') {
+    std::snprintf(name, sizeof(name), "localhost");
+  }
+  std::string host = name;
+  for (char& c : host) {
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '.') {
+      c = '_';
+    }
+  }
+  return host + "-" + std::to_string(std::max(1u, std::thread::hardware_concurrency())) + "cpu";
+}
+
+// Projected allocation of one context.
+struct MemoryPlan {
+  uint32_t m_nCtx{0};
+  std::uintmax_t m_kvBytes{0};
+  std::uintmax_t m_computeBytes{0};
+};
+
+std::string format_rate(double tokensPerSecond) {
+  char text[32];
+  std::snprintf(text, sizeof(text), "%.1f tok/s", tokensPerSecond);
+  return text;
+}
+
+std::string format_mib(std::uintmax_t bytes) { return std::to_string((bytes + (1u << 20) - 1) >> 20) + " MiB"; }
+
+bool vocabs_compatible(const llama_vocab* a, const llama_vocab* b) {
+  return llama_vocab_type(a) == llama_vocab_type(b) && llama_vocab_n_tokens(a) == llama_vocab_n_tokens(b) &&
+         llama_vocab_bos(a) == llama_vocab_bos(b) && llama_vocab_eos(a) == llama_vocab_eos(b);
+}
+
+// One KV sequence of the shared context. Each in-flight request owns a slot;
+// an idle slot keeps its cache so the next turn of the same session (or any
+// prompt sharing its prefix) only prefills the new tail.
+struct Slot {
+  llama_seq_id m_seqId{0};
+  std::vector<llama_token> m_cached;
+  std::string m_sessionStatePath;
+  bool m_snapshotDirty{false};
+  bool m_busy{false};
+  std::uint64_t m_lastUsed{0};
+};
+
+// A prefilled request taking part in the shared decode steps. Steps may run on
+// any caller's thread, so pieces are queued in m_outbox and streamed by the
+// owning generate() call outside the lock.
+struct ActiveRequest {
+  Slot* m_slot{nullptr};
+  const GenerationRequest* m_request{nullptr};
+  std::unique_ptr<llama_sampler, SamplerDeleter> m_sampler{nullptr};
+  llama_token m_pending{LLAMA_TOKEN_NULL};
+  std::vector<std::string> m_outbox;
+  std::string m_output;
+  std::vector<std::int32_t> m_generatedIds;
+  // Offset in m_output where each generated token's text starts.
+  std::vector<std::size_t> m_tokenOffsets;
+  StopSequenceMatcher m_stop;
+  RepetitionDetector m_repetition;
+  std::size_t m_promptTokens{0};
+  // Generated tokens dropped from the answer after they were decoded.
+  std::size_t m_cutTokens{0};
+  std::size_t m_repetitionSavedTokens{0};
+  std::string m_stopReason{"eos"};
+  std::size_t m_draftedTokens{0};
+  std::size_t m_acceptedDraftTokens{0};
+  std::chrono::steady_clock::time_point m_tStart;
+  // End of the request's max_latency_ms budget.
+  std::chrono::steady_clock::time_point m_deadline{std::chrono::steady_clock::time_point::max()};
+  // Alternatives forked for /retry decode alongside but are never streamed.
+  bool m_streaming{true};
+  // Cleared when a stop sequence cuts through a token's text.
+  bool m_idsMatchText{true};
+  double m_firstTokenMs{0.0};
+  bool m_firstTokenRecorded{false};
+  bool m_done{false};
+  bool m_cancelled{false};
+  std::string m_error;
+};
+
+// Why a request has to stop before its next decode ("cancelled" or
+// "time_budget"), or nullptr to go on. Also polled from llama's abort
+// callback, so it must stay cheap.
+const char* interrupt_reason(const ActiveRequest& active) {
+  if (active.m_request->m_cancel != nullptr && active.m_request->m_cancel->load()) {
+    return "cancelled";
+  }
+  if (std::chrono::steady_clock::now() >= active.m_deadline) {
+    return "time_budget";
+  }
+  return nullptr;
+}
+
+// Everything that belongs to one model: weights, context, slots and caches.
+// The runtime serves from its own copy of these fields; a LoadedModel holds a
+// model that is being staged in the background or kept resident after a
+// switch, and swap_current() exchanges the two.
+struct LoadedModel {
+  std::string m_path;
+  std::string m_key;
+  // Declared before the context so they outlive it.
+  ThreadpoolPtr m_decodePool{nullptr};
+  ThreadpoolPtr m_batchPool{nullptr};
+  std::unique_ptr<llama_model, ModelDeleter> m_model{nullptr};
+  std::unique_ptr<llama_context, ContextDeleter> m_context{nullptr};
+  std::vector<Slot> m_slots;
+  PrefixTree m_prefixTree;
+  std::vector<llama_seq_id> m_freeCacheSeqs;
+  std::size_t m_prefixCacheBudgetTokens{0};
+  std::unordered_map<std::string, std::vector<llama_token>> m_spanTokens;
+  ModelShape m_shape;
+  ThreadSettings m_threads;
+  // Weights plus KV cache, charged against the residency budget.
+  std::uintmax_t m_bytes{0};
+};
+
 class LlamaInprocRuntime final : public IModelRuntime {
  public:
   explicit LlamaInprocRuntime(LlamaRuntimeOptions options) : m_options(std::move(options)) {
     m_options.m_profile = normalize_profile(m_options.m_profile);
+    m_options.m_kvCacheType = normalize_kv_type(m_options.m_kvCacheType, m_options.m_profile);
+    m_options.m_flashAttn = normalize_flash_attn(m_options.m_flashAttn, m_options.m_kvCacheType, m_options.m_profile);
+    if (!m_options.m_cpuSet.empty()) {
+      m_pinnedCpus = parse_cpu_list(m_options.m_cpuSet);
+    } else if (m_options.m_numaNode >= 0) {
+      m_pinnedCpus = numa_node_cpus(m_options.m_numaNode);
+    }
   }
 
+  ~LlamaInprocRuntime() override { stop_loaders(); }
+
   std::string name() const override { return "llama-inproc"; }
 
   bool is_available() const override { return true; }
 
+  // Loads the model and its context on a background thread while the current
+  // model keeps serving, then swaps it in once no request is in flight and
+  // runs a one-token warmup decode. A request for the model being staged
+  // waits for it instead of starting a second load.
+  // A previous background load is cancelled, not joined: it exits on its own
+  // at its next progress callback or before installing anything, so
+  // `/model use` from a daemon client never waits for it.
+  void preload(const std::string& modelPath) override {
+    if (modelPath.empty()) {
+      return;
+    }
+    const auto progress = std::make_shared<LoadProgress>();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_stagingPath == modelPath) {
+        return;
+      }
+      if (m_loaderProgress) {
+        m_loaderProgress->m_cancel.store(true);
+      }
+      m_loaderProgress = progress;
+      m_stagingPath = modelPath;
+      begin_load(progress);
+      m_loaders.erase(std::remove_if(m_loaders.begin(), m_loaders.end(),
+                                     [](const std::future<void>& loader) {
+                                       return loader.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+                                     }),
+                      m_loaders.end());
+      m_loaders.push_back(
+          std::async(std::launch::async, [this, modelPath, progress] { run_loader(modelPath, progress); }));
+    }
+    m_slotFree.notify_all();
+  }
+
+  bool is_model_ready(const std::string& modelPath) const override {
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    return m_readyModelPath == modelPath;
+  }
+
+  void set_context_tokens(std::size_t tokens) override { m_contextTokens.store(tokens); }
+
+  std::string memory_plan() const override {
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    if (m_planShape.m_kvBytesPerToken == 0) {
+      return "";
+    }
+    const MemoryPlan plan = plan_memory(m_planShape, m_planThreads);
+    std::string text = "n_ctx " + std::to_string(plan.m_nCtx) + " (model max " +
+                       std::to_string(m_planShape.m_nCtxTrain) + "), KV " + format_mib(plan.m_kvBytes) + " (" +
+                       m_options.m_kvCacheType + ", " + std::to_string(m_planShape.m_kvBytesPerToken) +
+                       " B/token), compute ~" + format_mib(plan.m_computeBytes) +
+                       " (flash_attn " + m_options.m_flashAttn + ")";
+    if (m_allocatedCtx != 0 && m_allocatedCtx != plan.m_nCtx) {
+      text += "; allocated n_ctx " + std::to_string(m_allocatedCtx) + ", resized on the next request";
+    }
+    return text;
+  }
+
+  std::vector<std::string> resident_models() const override {
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    return m_residentPaths;
+  }
+
+  std::string load_status() const override {
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    if (m_loadState == "loading" && m_loadProgress) {
+      return "loading " + std::to_string(static_cast<int>(m_loadProgress->m_fraction.load() * 100.0f)) + "%";
+    }
+    return m_loadState;
+  }
+
+  // Sweeps n_batch and threads_batch over a synthetic prompt, then decode
+  // threads over single-token steps, and writes the fastest combination to
+  // the tune file for this model and host. Candidates are half, all and one
+  // less than the physical cores plus every logical CPU, since SMT siblings
+  // often slow decode down.
+  std::string tune(const std::string& modelPath, StreamCallback on_progress) override {
+    if (m_options.m_tuneDir.empty()) {
+      throw std::runtime_error("tune_dir is empty; set it in sentra.conf");
+    }
+    ensure_backend_init();
+    // With llama_cpu_set or llama_numa_node the sweep runs on those CPUs
+    // only; llama's worker threads inherit this thread's mask.
+    ScopedAffinity pinned(m_pinnedCpus);
+    std::unique_ptr<llama_model, ModelDeleter> model = load_model_file(modelPath);
+    const llama_vocab* vocab = llama_model_get_vocab(model.get());
+    const int nVocab = std::max(1, llama_vocab_n_tokens(vocab));
+
+    const int cpuLimit = m_pinnedCpus.empty() ? std::numeric_limits<int>::max() : static_cast<int>(m_pinnedCpus.size());
+    const int physical = std::min(physical_core_count(), cpuLimit);
+    const int logical = std::min(static_cast<int>(std::max(1u, std::thread::hardware_concurrency())), cpuLimit);
+    std::set<int> threadSet{std::max(1, physical / 2), std::max(1, physical - 1), physical, logical};
+    const std::vector<int> threadCandidates(threadSet.begin(), threadSet.end());
+    const std::vector<int> batchCandidates{256, 512, 1024};
+    // Twice the largest n_batch, so every candidate splits the prompt
+    // differently; a prompt that fits one ubatch times the same work twice.
+    constexpr std::size_t kPromptTokens = 2048;
+    constexpr std::size_t kDecodeTokens = 32;
+
+    std::vector<llama_token> prompt(kPromptTokens);
+    for (std::size_t i = 0; i < prompt.size(); ++i) {
+      prompt[i] = static_cast<llama_token>((i * 7919 + 13) % static_cast<std::size_t>(nVocab));
+    }
+    auto report = [&](const std::string& line) {
+      if (on_progress) {
+        on_progress(line + "\n");
+      }
+    };
+    report("host " + host_key() + ": " + std::to_string(physical) + " physical cores, " + std::to_string(logical) +
+           " logical CPUs");
+
+    ThreadSettings best;
+    double bestPrefill = 0.0;
+    std::unique_ptr<llama_context, ContextDeleter> bestContext;
+    for (const int nBatch : batchCandidates) {
+      const ThreadSettings batchOnly{.m_nThreads = 0, .m_nThreadsBatch = 0, .m_nBatch = nBatch};
+      llama_context_params ctxParams = context_params(static_cast<uint32_t>(kPromptTokens), batchOnly);
+      ctxParams.n_seq_max = 1;
+      std::unique_ptr<llama_context, ContextDeleter> ctx(llama_init_from_model(model.get(), ctxParams));
+      if (!ctx) {
+        throw std::runtime_error("llama-inproc failed to create tuning context (n_batch " + std::to_string(nBatch) +
+                                 ")");
+      }
+      bool improved = false;
+      for (std::size_t i = 0; i <= threadCandidates.size(); ++i) {
+        // The first pass is untimed so page faults on the mmap'd weights do
+        // not count against whichever setting runs first.
+        const int nThreadsBatch = threadCandidates[i == 0 ? 0 : i - 1];
+        llama_set_n_threads(ctx.get(), nThreadsBatch, nThreadsBatch);
+        llama_memory_clear(llama_get_memory(ctx.get()), true);
+        std::vector<llama_token> cached;
+        const auto tStart = std::chrono::steady_clock::now();
+        prefill(ctx.get(), 0, cached, prompt, nullptr);
+        llama_synchronize(ctx.get());
+        const double ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(
+                              std::chrono::steady_clock::now() - tStart)
+                              .count();
+        if (i == 0) {
+          continue;
+        }
+        const double tps = ms > 0.0 ? static_cast<double>(kPromptTokens) * 1000.0 / ms : 0.0;
+        report("prefill n_batch=" + std::to_string(nBatch) + " threads_batch=" + std::to_string(nThreadsBatch) +
+               ": " + format_rate(tps));
+        if (tps > bestPrefill) {
+          bestPrefill = tps;
+          best.m_nBatch = nBatch;
+          best.m_nThreadsBatch = nThreadsBatch;
+          improved = true;
+        }
+      }
+      if (improved) {
+        bestContext = std::move(ctx);
+      }
+    }
+    if (!bestContext) {
+      throw std::runtime_error("llama-inproc prefill made no progress while tuning");
+    }
+
+    double bestDecode = 0.0;
+    std::unique_ptr<llama_batch, BatchDeleter> batch = make_batch(1);
+    for (const int nThreads : threadCandidates) {
+      llama_set_n_threads(bestContext.get(), nThreads, best.m_nThreadsBatch);
+      llama_memory_clear(llama_get_memory(bestContext.get()), true);
+      std::vector<llama_token> cached;
+      prefill(bestContext.get(), 0, cached, std::vector<llama_token>(prompt.begin(), prompt.begin() + 64), nullptr);
+      const auto tStart = std::chrono::steady_clock::now();
+      for (std::size_t i = 0; i < kDecodeTokens; ++i) {
+        batch->token[0] = prompt[64 + i];
+        batch->pos[0] = static_cast<llama_pos>(64 + i);
+        batch->n_seq_id[0] = 1;
+        batch->seq_id[0][0] = 0;
+        batch->logits[0] = 1;
+        batch->n_tokens = 1;
+        if (llama_decode(bestContext.get(), *batch) != 0) {
+          throw std::runtime_error("llama-inproc decode failed while tuning");
+        }
+      }
+      llama_synchronize(bestContext.get());
+      const double ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(
+                            std::chrono::steady_clock::now() - tStart)
+                            .count();
+      const double tps = ms > 0.0 ? static_cast<double>(kDecodeTokens) * 1000.0 / ms : 0.0;
+      report("decode threads=" + std::to_string(nThreads) + ": " + format_rate(tps));
+      if (tps > bestDecode) {
+        bestDecode = tps;
+        best.m_nThreads = nThreads;
+      }
+    }
+
+    const std::string path = tune_file_path(modelPath);
+    std::error_code ec;
+    std::filesystem::create_directories(m_options.m_tuneDir, ec);
+    std::ofstream out(path, std::ios::trunc);
+    if (!out.is_open()) {
+      throw std::runtime_error("failed to write tune file: " + path);
+    }
+    out << "# sentra tune for " << modelPath << " on " << host_key() << "\n";
+    out << "# prefill " << format_rate(bestPrefill) << ", decode " << format_rate(bestDecode) << "\n";
+    out << "llama_n_threads=" << best.m_nThreads << "\n";
+    out << "llama_n_threads_batch=" << best.m_nThreadsBatch << "\n";
+    out << "llama_n_batch=" << best.m_nBatch << "\n";
+    report("best: llama_n_threads=" + std::to_string(best.m_nThreads) +
+           " llama_n_threads_batch=" + std::to_string(best.m_nThreadsBatch) +
+           " llama_n_batch=" + std::to_string(best.m_nBatch));
+    return path;
+  }
+
+  // Concurrent callers share one context: each request is prefilled into its
+  // own sequence and then joins the decode steps, which batch the next token
+  // (plus any draft) of every active request into a single llama_decode.
+  // Whichever caller holds the lock runs the next step for everyone.
   GenerationResult generate(const GenerationRequest& request, StreamCallback on_token) override {
     if (request.m_modelPath.empty()) {
       throw std::runtime_error("llama-inproc requires a non-empty model_path");
     }
 
-    std::lock_guard<std::mutex> lock(m_mutex);
+    std::unique_lock<std::mutex> lock(m_mutex);
     ensure_backend_init();
+    // A background load of this model finishes first; switching models swaps
+    // the context, so wait for in-flight sequences of the current one too.
+    m_slotFree.wait(lock, [&] {
+      return m_stagingPath != request.m_modelPath &&
+             ((m_loadedModelPath == request.m_modelPath && !needs_resize()) || context_idle());
+    });
     ensure_model_loaded(request.m_modelPath);
-    ensure_context();
+    if (needs_resize()) {
+      resize_context();
+    }
+    ensure_draft_loaded(request.m_draftModelPath);
 
     const llama_vocab* vocab = llama_model_get_vocab(m_model.get());
     if (!vocab) {
       throw std::runtime_error("llama-inproc failed to get model vocab");
     }
 
-    const std::string prompt = render_prompt(request);
-    std::vector<llama_token> promptTokens = tokenize(vocab, prompt);
+    // The orchestrator prunes by a word estimate, which undercounts code by
+    // 3x or more; drop the oldest messages by real token count so the prompt
+    // and max_tokens always fit the context instead of failing in decode.
+    const std::size_t nCtx = llama_n_ctx(m_context.get());
+    if (request.m_maxTokens >= nCtx) {
+      throw std::runtime_error("llama-inproc max_tokens " + std::to_string(request.m_maxTokens) +
+                               " does not fit the context of " + std::to_string(nCtx) + " tokens");
+    }
+    const std::size_t promptLimit = nCtx - request.m_maxTokens;
+    std::size_t pinnedTokens = 0;
+    std::vector<std::size_t> messageTokens;
+    std::vector<llama_token> promptTokens =
+        assemble_prompt(vocab, request, request.m_messages, pinnedTokens, messageTokens);
+    std::string contextWarning;
+    if (promptTokens.size() > promptLimit) {
+      const std::size_t fullSize = promptTokens.size();
+      std::size_t messageTotal = 0;
+      for (const std::size_t count : messageTokens) {
+        messageTotal += count;
+      }
+      const std::size_t framing = fullSize - messageTotal;
+      const ContextPruneResult fitted = prune_to_token_counts(
+          request.m_messages, messageTokens, promptLimit > framing ? promptLimit - framing : 0);
+      if (fitted.m_truncated) {
+        promptTokens = assemble_prompt(vocab, request, fitted.m_messages, pinnedTokens, messageTokens);
+      }
+      if (promptTokens.size() > promptLimit) {
+        throw std::runtime_error("llama-inproc prompt of " + std::to_string(promptTokens.size()) +
+                                 " tokens does not fit the context of " + std::to_string(nCtx) +
+                                 " tokens with max_tokens " + std::to_string(request.m_maxTokens) +
+                                 "; lower max_tokens or start a new session");
+      }
+      contextWarning = "prompt trimmed from " + std::to_string(fullSize) + " to " +
+                       std::to_string(promptTokens.size()) + " tokens to fit the llama context (dropped " +
+                       std::to_string(request.m_messages.size() - fitted.m_messages.size()) + " messages)";
+    }
     if (promptTokens.empty()) {
       throw std::runtime_error("llama-inproc tokenization produced zero tokens");
     }
 
-    const auto tStart = std::chrono::steady_clock::now();
-    const std::size_t prefix = common_prefix(m_cachedPromptTokens, promptTokens);
-    if (prefix != m_cachedPromptTokens.size()) {
-      llama_memory_clear(llama_get_memory(m_context.get()), true);
-      m_cachedPromptTokens.clear();
-    }
+    Slot& slot = acquire_slot(lock, request.m_sessionStatePath, promptTokens);
+    ActiveRequest active;
+    start_request(active, slot, request, promptTokens.size(), std::chrono::steady_clock::now());
+    // Extra samples for /retry n: each fork gets its own sequence holding a
+    // copy of the prompt's KV (shared cells in the unified pool) and decodes
+    // in the same steps as the main answer.
+    std::vector<Slot> forkSlots;
+    std::vector<ActiveRequest> forks;
+
+    std::size_t evictedTokens = 0;
+    std::size_t reusedTokens = 0;
+    std::size_t prefillTokens = 0;
+    double prefillMs = 0.0;
+    try {
+      load_prefix_blob_for(promptTokens, pinnedTokens);
+      adopt_cached_prefix(slot, promptTokens);
+      evictedTokens = evict_dropped_span(slot, promptTokens, pinnedTokens);
+      // Keep the KV for the shared prefix and drop only the divergent tail. The
+      // last prompt token is always re-decoded so sampling has fresh logits.
+      const std::size_t prefix = std::min(common_prefix(slot.m_cached, promptTokens), promptTokens.size() - 1);
+      truncate_cache(slot, prefix);
 
-    if (promptTokens.size() > m_cachedPromptTokens.size()) {
-      std::vector<llama_token> suffix(
-          promptTokens.begin() + static_cast<std::ptrdiff_t>(m_cachedPromptTokens.size()), promptTokens.end());
-      llama_batch promptBatch = llama_batch_get_one(suffix.data(), static_cast<int32_t>(suffix.size()));
-      const int promptRc = llama_decode(m_context.get(), promptBatch);
-      if (promptRc != 0) {
-        throw std::runtime_error("llama-inproc prompt decode failed: code " + std::to_string(promptRc));
+      reusedTokens = slot.m_cached.size();
+      prefillTokens = promptTokens.size() - slot.m_cached.size();
+      slot.m_snapshotDirty = true;
+      // Running requests get one decode step between prefill chunks, so a long
+      // prompt being admitted delays their next token by at most one chunk.
+      // The abort callback only watches this request (Ctrl-C, time budget)
+      // while its own chunks decode, so stopping it never aborts the others'
+      // steps.
+      set_abort_check(&active);
+      prefillMs = prefill(m_context.get(), slot.m_seqId, slot.m_cached, promptTokens, request.m_onPrefillProgress,
+                          [this, &active] {
+                            if (!m_active.empty()) {
+                              set_abort_check(nullptr);
+                              run_step();
+                              set_abort_check(&active);
+                            }
+                          });
+      set_abort_check(nullptr);
+      if (slot.m_cached.size() < promptTokens.size()) {
+        release_slot(slot);
+        const char* reason = interrupt_reason(active);
+        GenerationResult interrupted;
+        interrupted.m_tokensModel = request.m_modelId;
+        interrupted.m_totalMs = prefillMs;
+        interrupted.m_prefillTokens = slot.m_cached.size() - reusedTokens;
+        interrupted.m_reusedTokens = reusedTokens;
+        interrupted.m_stopReason = reason != nullptr ? reason : "cancelled";
+        interrupted.m_cancelled = interrupted.m_stopReason == "cancelled";
+        return interrupted;
       }
-      m_cachedPromptTokens = promptTokens;
-    }
 
-    llama_sampler* sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
-    if (!sampler) {
-      throw std::runtime_error("llama-inproc failed to initialize sampler chain");
+      remember_prefix(slot, promptTokens, pinnedTokens);
+
+      active.m_sampler = make_sampler();
+      active.m_pending = llama_sampler_sample(active.m_sampler.get(), m_context.get(), -1);
+      llama_sampler_accept(active.m_sampler.get(), active.m_pending);
+
+      // Forks sample their first token from the same prompt logits.
+      const std::size_t forkCount = forks_that_fit(request);
+      // Reserved up front: forks point at their slots.
+      forkSlots.reserve(forkCount);
+      forks.reserve(forkCount);
+      for (std::size_t k = 0; k < forkCount; ++k) {
+        Slot& forkSlot = forkSlots.emplace_back();
+        forkSlot.m_seqId = m_freeCacheSeqs.back();
+        m_freeCacheSeqs.pop_back();
+        ++m_activeForks;
+        forkSlot.m_busy = true;
+        forkSlot.m_cached = slot.m_cached;
+        llama_memory_t memory = llama_get_memory(m_context.get());
+        llama_memory_seq_rm(memory, forkSlot.m_seqId, -1, -1);
+        llama_memory_seq_cp(memory, slot.m_seqId, forkSlot.m_seqId, -1, -1);
+        ActiveRequest& fork = forks.emplace_back();
+        start_request(fork, forkSlot, request, promptTokens.size(), active.m_tStart);
+        fork.m_streaming = false;
+        fork.m_sampler = make_sampler();
+        fork.m_pending = llama_sampler_sample(fork.m_sampler.get(), m_context.get(), -1);
+        llama_sampler_accept(fork.m_sampler.get(), fork.m_pending);
+      }
+    } catch (...) {
+      set_abort_check(nullptr);
+      release_forks(forkSlots);
+      release_slot(slot);
+      throw;
     }
 
-    const int topK = m_options.m_profile == "fast" ? 20 : (m_options.m_profile == "quality" ? 60 : 40);
-    const float topP = m_options.m_profile == "quality" ? 0.98f : 0.95f;
-    const float temp = m_options.m_profile == "fast" ? 0.6f : (m_options.m_profile == "quality" ? 0.8f : 0.7f);
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_k(topK));
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_p(topP, 1));
-    llama_sampler_chain_add(sampler, llama_sampler_init_temp(temp));
-    llama_sampler_chain_add(sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-
-    std::string output;
-    output.reserve(request.m_maxTokens * 4);
-    std::size_t generatedTokens = 0;
-    bool firstTokenRecorded = false;
-    double firstTokenMs = 0.0;
-
-    for (std::size_t i = 0; i < request.m_maxTokens; ++i) {
-      const llama_token token = llama_sampler_sample(sampler, m_context.get(), -1);
-      if (token == LLAMA_TOKEN_NULL || llama_vocab_is_eog(vocab, token)) {
-        break;
+    // `m_pending` has been sampled from the latest logits but not decoded yet;
+    // each step decodes it together with any drafted continuation.
+    for (ActiveRequest* started : with_forks(active, forks)) {
+      if (emit(*started, started->m_pending)) {
+        m_active.push_back(started);
+      } else {
+        finish(*started);
       }
-      llama_sampler_accept(sampler, token);
-      ++generatedTokens;
+    }
 
-      const std::string piece = token_to_text(vocab, token);
-      if (!piece.empty()) {
-        if (!firstTokenRecorded) {
-          firstTokenRecorded = true;
-          const auto now = std::chrono::steady_clock::now();
-          firstTokenMs =
-              std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(now - tStart).count();
+    while (true) {
+      if (!active.m_outbox.empty()) {
+        std::vector<std::string> pieces;
+        pieces.swap(active.m_outbox);
+        lock.unlock();
+        try {
+          for (const auto& piece : pieces) {
+            on_token(piece);
+          }
+        } catch (...) {
+          lock.lock();
+          if (!active.m_done) {
+            finish(active);
+          }
+          finish_forks(forks, forkSlots, true);
+          throw;
         }
-        output += piece;
-        on_token(piece);
+        lock.lock();
+        continue;
       }
-
-      llama_token next = token;
-      llama_batch nextBatch = llama_batch_get_one(&next, 1);
-      const int rc = llama_decode(m_context.get(), nextBatch);
-      if (rc != 0) {
-        llama_sampler_free(sampler);
-        throw std::runtime_error("llama-inproc token decode failed: code " + std::to_string(rc));
+      if (active.m_done) {
+        break;
+      }
+      run_step();
+    }
+    finish_forks(forks, forkSlots, !active.m_error.empty());
+    if (!active.m_error.empty()) {
+      throw std::runtime_error(active.m_error);
+    }
+    std::vector<GenerationAlternative> alternatives;
+    for (ActiveRequest& fork : forks) {
+      if (fork.m_error.empty()) {
+        alternatives.push_back({.m_text = std::move(fork.m_output),
+                                .m_tokens = fork.m_idsMatchText ? std::move(fork.m_generatedIds)
+                                                                : std::vector<llama_token>{},
+                                .m_stopReason = std::move(fork.m_stopReason)});
       }
-      m_cachedPromptTokens.push_back(token);
     }
 
-    llama_sampler_free(sampler);
     const auto tEnd = std::chrono::steady_clock::now();
     const double totalMs =
-        std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(tEnd - tStart).count();
+        std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(tEnd - active.m_tStart).count();
+    const std::size_t generatedTokens = active.m_generatedIds.size() + active.m_cutTokens;
     const double tokensPerSecond =
         totalMs > 0.0 ? (static_cast<double>(generatedTokens) * 1000.0 / totalMs) : 0.0;
-    return {.m_text = output,
-            .m_contextTruncated = false,
-            .m_warning = "",
-            .m_firstTokenMs = firstTokenMs,
+    const double prefillTokensPerSecond =
+        prefillMs > 0.0 ? (static_cast<double>(prefillTokens) * 1000.0 / prefillMs) : 0.0;
+    return {.m_text = std::move(active.m_output),
+            .m_contextTruncated = !contextWarning.empty(),
+            .m_warning = m_draftWarning.empty() || contextWarning.empty()
+                             ? m_draftWarning + contextWarning
+                             : m_draftWarning + "; " + contextWarning,
+            .m_firstTokenMs = active.m_firstTokenMs,
             .m_totalMs = totalMs,
             .m_generatedTokens = generatedTokens,
-            .m_tokensPerSecond = tokensPerSecond};
+            .m_tokensPerSecond = tokensPerSecond,
+            .m_prefillTokens = prefillTokens,
+            .m_prefillTokensPerSecond = prefillTokensPerSecond,
+            .m_reusedTokens = reusedTokens,
+            .m_evictedTokens = evictedTokens,
+            .m_tokens = active.m_idsMatchText ? std::move(active.m_generatedIds) : std::vector<llama_token>{},
+            .m_tokensModel = active.m_idsMatchText ? request.m_modelId : std::string(),
+            .m_draftedTokens = active.m_draftedTokens,
+            .m_acceptedDraftTokens = active.m_acceptedDraftTokens,
+            .m_cancelled = active.m_cancelled,
+            .m_stopReason = std::move(active.m_stopReason),
+            .m_repetitionSavedTokens = active.m_repetitionSavedTokens,
+            .m_alternatives = std::move(alternatives)};
+  }
+
+  void save_session_state() override {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& slot : m_slots) {
+      if (!slot.m_busy) {
+        save_slot(slot);
+      }
+    }
+    for (auto& resident : m_resident) {
+      for (auto& slot : resident->m_slots) {
+        save_slot(resident->m_context.get(), resident->m_path, slot);
+      }
+    }
   }
 
  private:
-  static void ensure_backend_init() {
-    static std::once_flag once;
-    std::call_once(once, []() {
-      ggml_backend_load_all();
-      llama_backend_init();
-      llama_log_set(llama_silent_log_callback, nullptr);
-    });
+  void set_load_state(std::string state) {
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    m_loadState = std::move(state);
   }
 
-  void ensure_model_loaded(const std::string& modelPath) {
-    if (m_model && m_loadedModelPath == modelPath) {
-      return;
-    }
+  // Makes progress the record load_status() reports.
+  void begin_load(std::shared_ptr<LoadProgress> progress) {
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    m_loadProgress = std::move(progress);
+    m_loadState = "loading";
+  }
 
-    llama_model_params modelParams = llama_model_default_params();
-    modelParams.use_mmap = true;
-    modelParams.use_mlock = false;
-    modelParams.n_gpu_layers = 0;
-    ggml_backend_dev_t cpuDevice = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
-    ggml_backend_dev_t devices[2] = {cpuDevice, nullptr};
-    if (cpuDevice != nullptr) {
-      modelParams.devices = devices;
-    }
+  // Body of a background load started by preload(). Once progress is
+  // cancelled a newer load owns the status and m_stagingPath, so this one
+  // drops what it staged and leaves both alone.
+  void run_loader(const std::string& modelPath, const std::shared_ptr<LoadProgress>& progress) {
+    try {
+      std::unique_ptr<LoadedModel> staged;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ensure_backend_init();
+        if (m_loadedModelPath != modelPath && find_resident(modelPath) == m_resident.end()) {
+          staged = std::make_unique<LoadedModel>();
+        }
+      }
+      if (staged) {
+        *staged = load_bundle(modelPath, progress.get());
+      }
 
-    std::unique_ptr<llama_model, ModelDeleter> nextModel(
-        llama_model_load_from_file(modelPath.c_str(), modelParams));
-    if (!nextModel) {
-      throw std::runtime_error("llama-inproc failed to load model file: " + modelPath);
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_slotFree.wait(lock, [&] { return context_idle() || progress->m_cancel.load(); });
+      if (progress->m_cancel.load()) {
+        return;
+      }
+      if (staged) {
+        install(std::move(*staged));
+        preload_prefix_blobs();
+        set_load_state("warming up");
+        warmup();
+      } else {
+        ensure_model_loaded(modelPath);
+      }
+      m_stagingPath.clear();
+      set_load_state("ready");
+      m_slotFree.notify_all();
+    } catch (const std::exception& ex) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (progress->m_cancel.load()) {
+        return;
+      }
+      m_stagingPath.clear();
+      set_load_state(std::string("failed: ") + ex.what());
+      m_slotFree.notify_all();
     }
+  }
 
-    m_model = std::move(nextModel);
-    m_loadedModelPath = modelPath;
-    m_context.reset();
-    m_cachedPromptTokens.clear();
+  void stop_loaders() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_loaderProgress) {
+        m_loaderProgress->m_cancel.store(true);
+      }
+    }
+    m_slotFree.notify_all();
+    for (std::future<void>& loader : m_loaders) {
+      loader.wait();
+    }
   }
 
-  void ensure_context() {
-    if (m_context) {
+  // Runs one token through the fresh context so first-use costs (weight
+  // page-in, backend graph allocation) are paid before the first question.
+  void warmup() {
+    set_load_state("warming up");
+    const llama_vocab* vocab = llama_model_get_vocab(m_model.get());
+    llama_token token = llama_vocab_bos(vocab);
+    if (token == LLAMA_TOKEN_NULL) {
+      token = llama_vocab_eos(vocab);
+    }
+    const llama_seq_id seq = m_slots.back().m_seqId;
+    if (token == LLAMA_TOKEN_NULL || !m_slots.back().m_cached.empty()) {
       return;
     }
+    std::unique_ptr<llama_batch, BatchDeleter> batch = make_batch(1);
+    batch->token[0] = token;
+    batch->pos[0] = 0;
+    batch->n_seq_id[0] = 1;
+    batch->seq_id[0][0] = seq;
+    batch->logits[0] = 1;
+    batch->n_tokens = 1;
+    if (llama_decode(m_context.get(), *batch) == 0) {
+      llama_synchronize(m_context.get());
+    }
+    llama_memory_seq_rm(llama_get_memory(m_context.get()), seq, -1, -1);
+  }
 
-    llama_context_params ctxParams = llama_context_default_params();
-    const uint32_t batch = static_cast<uint32_t>(m_options.m_nBatch > 0 ? m_options.m_nBatch : 512);
-    ctxParams.n_ctx = 0;
-    ctxParams.n_batch = batch;
-    ctxParams.n_ubatch = batch;
-    ctxParams.offload_kqv = m_options.m_offloadKqv;
-    ctxParams.op_offload = m_options.m_opOffload;
+  // Writes the slot's sequence to its session snapshot. Temporaries are
+  // renamed into place so an interrupted save never leaves a snapshot whose
+  // tokens disagree with its KV payload. The two renames are not one atomic
+  // step: if the metadata cannot follow the new payload, both are removed,
+  // and restore also checks the metadata's token count against the payload.
+  void save_slot(Slot& slot) { save_slot(m_context.get(), m_loadedModelPath, slot); }
 
-    m_context = std::unique_ptr<llama_context, ContextDeleter>(llama_init_from_model(m_model.get(), ctxParams));
-    if (!m_context) {
-      throw std::runtime_error("llama-inproc failed to create context");
+  static void save_slot(llama_context* ctx, const std::string& modelPath, Slot& slot) {
+    if (ctx == nullptr || !slot.m_snapshotDirty || slot.m_sessionStatePath.empty() || slot.m_cached.empty()) {
+      return;
     }
 
-    if (m_options.m_nThreads > 0 || m_options.m_nThreadsBatch > 0) {
-      const int nt = m_options.m_nThreads > 0 ? m_options.m_nThreads : llama_n_threads(m_context.get());
-      const int ntb =
-          m_options.m_nThreadsBatch > 0 ? m_options.m_nThreadsBatch : llama_n_threads_batch(m_context.get());
-      llama_set_n_threads(m_context.get(), nt, ntb);
+    const std::string tmpPath = slot.m_sessionStatePath + ".tmp";
+    const std::string metaPath = slot.m_sessionStatePath + ".meta";
+    const std::string tmpMetaPath = metaPath + ".tmp";
+    std::error_code ec;
+    const std::size_t written = llama_state_seq_save_file(ctx, tmpPath.c_str(), slot.m_seqId,
+                                                          slot.m_cached.data(), slot.m_cached.size());
+    if (written == 0) {
+      std::filesystem::remove(tmpPath, ec);
+      return;
     }
+    {
+      std::ofstream meta(tmpMetaPath, std::ios::trunc);
+      if (!meta.is_open()) {
+        std::filesystem::remove(tmpPath, ec);
+        return;
+      }
+      meta << "model_path=" << modelPath << "\n";
+      meta << "model_bytes=" << model_file_bytes(modelPath) << "\n";
+      meta << "n_tokens=" << slot.m_cached.size() << "\n";
+    }
+    std::filesystem::rename(tmpPath, slot.m_sessionStatePath, ec);
+    if (ec) {
+      std::filesystem::remove(tmpPath, ec);
+      std::filesystem::remove(tmpMetaPath, ec);
+      return;
+    }
+    std::filesystem::rename(tmpMetaPath, metaPath, ec);
+    if (ec) {
+      std::filesystem::remove(slot.m_sessionStatePath, ec);
+      std::filesystem::remove(metaPath, ec);
+      std::filesystem::remove(tmpMetaPath, ec);
+      return;
+    }
+    slot.m_snapshotDirty = false;
   }
 
-  static std::vector<llama_token> tokenize(const llama_vocab* vocab, const std::string& text) {
-    std::vector<llama_token> tokens(static_cast<std::size_t>(text.size()) + 16);
-    int32_t n = llama_tokenize(vocab, text.c_str(), static_cast<int32_t>(text.size()), tokens.data(),
-                               static_cast<int32_t>(tokens.size()), true, true);
-    if (n < 0) {
-      const int32_t required = -n;
-      tokens.assign(static_cast<std::size_t>(required), 0);
-      n = llama_tokenize(vocab, text.c_str(), static_cast<int32_t>(text.size()), tokens.data(), required, true, true);
+  std::size_t busy_slots() const {
+    return static_cast<std::size_t>(
+        std::count_if(m_slots.begin(), m_slots.end(), [](const Slot& slot) { return slot.m_busy; }));
+  }
+
+  // No slot or /retry fork is decoding in the current context.
+  bool context_idle() const { return busy_slots() == 0 && m_activeForks == 0; }
+
+  void start_request(ActiveRequest& active, Slot& slot, const GenerationRequest& request, std::size_t promptTokens,
+                     std::chrono::steady_clock::time_point tStart) {
+    active.m_slot = &slot;
+    active.m_request = &request;
+    active.m_stop = StopSequenceMatcher(request.m_stopSequences);
+    active.m_repetition =
+        RepetitionDetector(request.m_repeatWindow, request.m_repeatThreshold, request.m_repeatMinTokens);
+    active.m_promptTokens = promptTokens;
+    active.m_tStart = tStart;
+    if (request.m_maxLatencyMs > 0) {
+      active.m_deadline = tStart + std::chrono::milliseconds(request.m_maxLatencyMs);
     }
-    if (n < 0) {
-      throw std::runtime_error("llama-inproc tokenization failed");
+  }
+
+  // Forks borrow spare prefix-cache sequences without evicting cached
+  // prefixes, and each needs room for max_tokens in the KV pool, so fewer
+  // than m_samples - 1 may fit.
+  std::size_t forks_that_fit(const GenerationRequest& request) const {
+    if (request.m_samples <= 1) {
+      return 0;
     }
-    tokens.resize(static_cast<std::size_t>(n));
-    return tokens;
+    std::size_t used = m_prefixTree.token_count();
+    for (const auto& slot : m_slots) {
+      used += slot.m_cached.size() + (slot.m_busy ? request.m_maxTokens : 0);
+    }
+    const std::size_t nCtx = llama_n_ctx(m_context.get());
+    const std::size_t room = nCtx > used ? (nCtx - used) / std::max<std::size_t>(1, request.m_maxTokens) : 0;
+    return std::min({request.m_samples - 1, m_freeCacheSeqs.size(), room});
   }
 
-  static std::string token_to_text(const llama_vocab* vocab, llama_token token) {
-    std::vector<char> buffer(32);
-    int32_t n = llama_token_to_piece(vocab, token, buffer.data(), static_cast<int32_t>(buffer.size()), 0, true);
-    if (n < 0) {
-      buffer.assign(static_cast<std::size_t>(-n), 0);
-      n = llama_token_to_piece(vocab, token, buffer.data(), static_cast<int32_t>(buffer.size()), 0, true);
+  static std::vector<ActiveRequest*> with_forks(ActiveRequest& active, std::vector<ActiveRequest>& forks) {
+    std::vector<ActiveRequest*> all{&active};
+    for (ActiveRequest& fork : forks) {
+      all.push_back(&fork);
     }
-    if (n <= 0) {
-      return "";
+    return all;
+  }
+
+  // Runs steps until every fork is done (or drops them when abandoning the
+  // request), then hands their sequences back to the spare pool.
+  void finish_forks(std::vector<ActiveRequest>& forks, std::vector<Slot>& forkSlots, bool abandon) {
+    for (ActiveRequest& fork : forks) {
+      while (!fork.m_done) {
+        if (abandon) {
+          finish(fork);
+        } else {
+          run_step();
+        }
+      }
     }
-    return std::string(buffer.data(), static_cast<std::size_t>(n));
+    release_forks(forkSlots);
   }
 
-  static std::size_t common_prefix(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
-    const std::size_t n = std::min(a.size(), b.size());
-    std::size_t i = 0;
-    while (i < n && a[i] == b[i]) {
-      ++i;
+  void release_forks(std::vector<Slot>& forkSlots) {
+    llama_memory_t memory = llama_get_memory(m_context.get());
+    for (const Slot& forkSlot : forkSlots) {
+      llama_memory_seq_rm(memory, forkSlot.m_seqId, -1, -1);
+      m_freeCacheSeqs.push_back(forkSlot.m_seqId);
+      --m_activeForks;
     }
-    return i;
+    forkSlots.clear();
+    m_slotFree.notify_all();
+  }
+
+  // Picks an idle slot for the prompt, waiting while all are busy: the slot
+  // that last served the same session, else the one sharing the longest
+  // prefix with the prompt, else the least recently used. A slot handed to a
+  // different session parks its old cache in that session's snapshot and
+  // restores the new session's snapshot when one exists.
+  Slot& acquire_slot(std::unique_lock<std::mutex>& lock, const std::string& sessionStatePath,
+                     const std::vector<llama_token>& promptTokens) {
+    Slot* chosen = nullptr;
+    m_slotFree.wait(lock, [&] { return busy_slots() < m_slots.size(); });
+    std::size_t bestPrefix = 0;
+    for (auto& slot : m_slots) {
+      if (slot.m_busy) {
+        continue;
+      }
+      if (!sessionStatePath.empty() && slot.m_sessionStatePath == sessionStatePath) {
+        chosen = &slot;
+        break;
+      }
+      const std::size_t prefix = common_prefix(slot.m_cached, promptTokens);
+      if (chosen == nullptr || prefix > bestPrefix ||
+          (prefix == bestPrefix && slot.m_lastUsed < chosen->m_lastUsed)) {
+        chosen = &slot;
+        bestPrefix = prefix;
+      }
+    }
+
+    Slot& slot = *chosen;
+    slot.m_busy = true;
+    if (slot.m_sessionStatePath != sessionStatePath || slot.m_cached.empty()) {
+      save_slot(slot);
+      slot.m_sessionStatePath = sessionStatePath;
+      restore_session_state(slot);
+    }
+    return slot;
+  }
+
+  // Copies the longest prefix-cache match into the slot when it beats what
+  // the slot already holds. With a unified KV cache the copy only tags the
+  // existing cells with the slot's sequence, so nothing is recomputed.
+  void adopt_cached_prefix(Slot& slot, const std::vector<llama_token>& promptTokens) {
+    if (m_prefixTree.entry_count() == 0) {
+      return;
+    }
+    const PrefixTree::Match match = m_prefixTree.longest_match(promptTokens);
+    const std::size_t length = std::min(match.m_length, promptTokens.size() - 1);
+    if (match.m_entry < 0 || length <= common_prefix(slot.m_cached, promptTokens)) {
+      return;
+    }
+    llama_memory_t memory = llama_get_memory(m_context.get());
+    llama_memory_seq_rm(memory, slot.m_seqId, -1, -1);
+    llama_memory_seq_cp(memory, match.m_entry, slot.m_seqId, 0, static_cast<llama_pos>(length));
+    slot.m_snapshotDirty = true;
+    // Recurrent memories cannot copy part of a sequence; start cold instead.
+    if (llama_memory_seq_pos_max(memory, slot.m_seqId) + 1 != static_cast<llama_pos>(length)) {
+      llama_memory_seq_rm(memory, slot.m_seqId, -1, -1);
+      slot.m_cached.clear();
+      return;
+    }
+    slot.m_cached.assign(promptTokens.begin(), promptTokens.begin() + static_cast<std::ptrdiff_t>(length));
+  }
+
+  // Adds the prompt's pinned prefix (BOS plus the leading system messages) to
+  // the prefix cache after it has been prefilled, evicting least recently used
+  // entries to stay within the entry and KV budgets.
+  void remember_prefix(const Slot& slot, const std::vector<llama_token>& promptTokens, std::size_t pinnedTokens) {
+    if (pinnedTokens < kMinCachedPrefix || pinnedTokens > slot.m_cached.size()) {
+      return;
+    }
+    const std::vector<llama_token> prefix(promptTokens.begin(),
+                                          promptTokens.begin() + static_cast<std::ptrdiff_t>(pinnedTokens));
+    const PrefixTree::Match match = m_prefixTree.longest_match(prefix);
+    if (match.m_length == pinnedTokens) {
+      return;
+    }
+    const llama_seq_id seq = reserve_cache_seq(pinnedTokens - match.m_length, true);
+    if (seq < 0) {
+      return;
+    }
+    llama_memory_seq_cp(llama_get_memory(m_context.get()), slot.m_seqId, seq, 0, static_cast<llama_pos>(pinnedTokens));
+    m_prefixTree.insert(prefix, seq);
+    save_prefix_blob(seq, prefix);
+  }
+
+  // Returns an empty spare sequence for a prefix adding newTokens to the cache,
+  // evicting least recently used entries (when allowed) to make room, or -1.
+  llama_seq_id reserve_cache_seq(std::size_t newTokens, bool evict) {
+    llama_memory_t memory = llama_get_memory(m_context.get());
+    const auto fits = [&] {
+      return !m_freeCacheSeqs.empty() && m_prefixTree.token_count() + newTokens <= m_prefixCacheBudgetTokens;
+    };
+    while (evict && m_prefixTree.entry_count() > 0 && !fits()) {
+      const int evicted = m_prefixTree.least_recent_entry();
+      m_prefixTree.erase(evicted);
+      llama_memory_seq_rm(memory, evicted, -1, -1);
+      m_freeCacheSeqs.push_back(evicted);
+    }
+    if (!fits()) {
+      return -1;
+    }
+    const llama_seq_id seq = m_freeCacheSeqs.back();
+    m_freeCacheSeqs.pop_back();
+    llama_memory_seq_rm(memory, seq, -1, -1);
+    return seq;
+  }
+
+  // Pinned prefixes are also written to prompt_cache_dir as
+  // <model key>-<prefix hash>.kv so a new process maps them back in instead of
+  // prefilling the system prompt again.
+  std::string prefix_blob_path(const std::vector<llama_token>& prefix) const {
+    return m_options.m_promptCacheDir + "/" + m_modelKey + "-" +
+           to_hex(fnv1a(prefix.data(), prefix.size() * sizeof(llama_token))) + ".kv";
+  }
+
+  void save_prefix_blob(llama_seq_id seq, const std::vector<llama_token>& prefix) const {
+    if (m_options.m_promptCacheDir.empty()) {
+      return;
+    }
+    const std::string path = prefix_blob_path(prefix);
+    std::error_code ec;
+    if (std::filesystem::exists(path, ec)) {
+      return;
+    }
+    std::filesystem::create_directories(m_options.m_promptCacheDir, ec);
+    const std::string tmpPath = path + ".tmp";
+    if (llama_state_seq_save_file(m_context.get(), tmpPath.c_str(), seq, prefix.data(), prefix.size()) == 0) {
+      std::filesystem::remove(tmpPath, ec);
+      return;
+    }
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec) {
+      std::filesystem::remove(tmpPath, ec);
+    }
+  }
+
+  // Loads a saved prefix into a spare sequence and indexes it. When expected
+  // is given the stored tokens must equal it, which guards against hash
+  // collisions and stale files.
+  bool load_prefix_blob(const std::string& path, const std::vector<llama_token>* expected, bool evict) {
+    const llama_seq_id seq = reserve_cache_seq(expected != nullptr ? expected->size() : 0, evict);
+    if (seq < 0) {
+      return false;
+    }
+    std::vector<llama_token> tokens(llama_n_ctx(m_context.get()));
+    std::size_t count = 0;
+    const std::size_t read =
+        llama_state_seq_load_file(m_context.get(), path.c_str(), seq, tokens.data(), tokens.size(), &count);
+    tokens.resize(count);
+    if (read == 0 || count < kMinCachedPrefix || (expected != nullptr && tokens != *expected) ||
+        m_prefixTree.token_count() + count > m_prefixCacheBudgetTokens) {
+      llama_memory_seq_rm(llama_get_memory(m_context.get()), seq, -1, -1);
+      m_freeCacheSeqs.push_back(seq);
+      return false;
+    }
+    const int replaced = m_prefixTree.insert(tokens, seq);
+    if (replaced >= 0) {
+      llama_memory_seq_rm(llama_get_memory(m_context.get()), replaced, -1, -1);
+      m_freeCacheSeqs.push_back(replaced);
+    }
+    return true;
+  }
+
+  void load_prefix_blob_for(const std::vector<llama_token>& promptTokens, std::size_t pinnedTokens) {
+    if (m_options.m_promptCacheDir.empty() || pinnedTokens < kMinCachedPrefix) {
+      return;
+    }
+    const std::vector<llama_token> prefix(promptTokens.begin(),
+                                          promptTokens.begin() + static_cast<std::ptrdiff_t>(pinnedTokens));
+    if (m_prefixTree.longest_match(prefix).m_length == pinnedTokens) {
+      return;
+    }
+    const std::string path = prefix_blob_path(prefix);
+    std::error_code ec;
+    if (std::filesystem::exists(path, ec)) {
+      load_prefix_blob(path, &prefix, true);
+    }
+  }
+
+  // Maps this model's most recently written prefix blobs into the spare
+  // sequences when the context is created.
+  void preload_prefix_blobs() {
+    std::error_code ec;
+    if (m_options.m_promptCacheDir.empty() || m_freeCacheSeqs.empty() ||
+        !std::filesystem::is_directory(m_options.m_promptCacheDir, ec)) {
+      return;
+    }
+    std::vector<std::filesystem::directory_entry> blobs;
+    for (const auto& entry : std::filesystem::directory_iterator(m_options.m_promptCacheDir, ec)) {
+      const std::string name = entry.path().filename().string();
+      if (name.rfind(m_modelKey + "-", 0) == 0 && entry.path().extension() == ".kv") {
+        blobs.push_back(entry);
+      }
+    }
+    std::sort(blobs.begin(), blobs.end(), [](const auto& a, const auto& b) {
+      std::error_code ignored;
+      return a.last_write_time(ignored) > b.last_write_time(ignored);
+    });
+    for (const auto& blob : blobs) {
+      if (m_freeCacheSeqs.empty()) {
+        break;
+      }
+      load_prefix_blob(blob.path().string(), nullptr, false);
+    }
+  }
+
+  // K and V for every layer in the configured cache type; quantized types
+  // store blocks of ggml_blck_size values in ggml_type_size bytes.
+  ModelShape shape_of(const llama_model* model) const {
+    ModelShape shape;
+    const int32_t nHead = std::max(1, llama_model_n_head(model));
+    const std::size_t nEmbdKv = static_cast<std::size_t>(llama_model_n_embd(model) / nHead) *
+                                static_cast<std::size_t>(llama_model_n_head_kv(model));
+    const ggml_type type = kv_ggml_type();
+    const std::size_t rowBytes =
+        nEmbdKv * ggml_type_size(type) / static_cast<std::size_t>(std::max<int64_t>(1, ggml_blck_size(type)));
+    shape.m_kvBytesPerToken = 2 * static_cast<std::size_t>(llama_model_n_layer(model)) * rowBytes;
+    shape.m_nHead = static_cast<std::size_t>(nHead);
+    shape.m_nVocab = static_cast<std::size_t>(std::max(0, llama_vocab_n_tokens(llama_model_get_vocab(model))));
+    shape.m_nCtxTrain = static_cast<uint32_t>(std::max(0, llama_model_n_ctx_train(model)));
+    return shape;
+  }
+
+  // Sizes the context from the orchestrator's window: every slot holds one
+  // window plus an eighth for template tokens and estimate error, and the
+  // prefix cache gets half a window of its own cells. Without a window the
+  // model's training context is used. Compute is dominated by the logits
+  // and the f32 attention scores of one ubatch.
+  MemoryPlan plan_memory(const ModelShape& shape, const ThreadSettings& threads) const {
+    MemoryPlan plan;
+    const std::size_t window = m_contextTokens.load();
+    std::size_t nCtx = shape.m_nCtxTrain;
+    if (window > 0) {
+      const std::size_t perSlot = window + window / 8;
+      nCtx = perSlot * static_cast<std::size_t>(std::max(1, m_options.m_nParallel)) +
+             (m_options.m_prefixCacheEntries > 0 ? perSlot / 2 : 0);
+      nCtx = (nCtx + 255) / 256 * 256;
+      if (shape.m_nCtxTrain > 0) {
+        nCtx = std::min<std::size_t>(nCtx, shape.m_nCtxTrain);
+      }
+    }
+    plan.m_nCtx = static_cast<uint32_t>(nCtx);
+    plan.m_kvBytes = static_cast<std::uintmax_t>(shape.m_kvBytesPerToken) * nCtx;
+    const llama_context_params ctxParams = context_params(plan.m_nCtx, threads);
+    // Flash attention never materializes the n_ctx x n_head score matrix.
+    const std::size_t scoreColumns = m_options.m_flashAttn == "off" ? nCtx * shape.m_nHead : 0;
+    plan.m_computeBytes = static_cast<std::uintmax_t>(ctxParams.n_ubatch) * (shape.m_nVocab + scoreColumns) * 4;
+    return plan;
+  }
+
+  bool needs_resize() const {
+    return m_context && plan_memory(m_loadedShape, m_loadedThreads).m_nCtx != llama_n_ctx(m_context.get());
+  }
+
+  // Recreates the current model's context at the planned size. Sessions are
+  // parked in their KV snapshots first and the prefix cache is rebuilt from
+  // its blobs; the draft context follows on the next request.
+  void resize_context() {
+    for (auto& slot : m_slots) {
+      save_slot(slot);
+    }
+    reset_draft();
+    LoadedModel bundle;
+    swap_current(bundle);
+    bundle.m_context.reset();
+    create_context(bundle);
+    swap_current(bundle);
+    preload_prefix_blobs();
+  }
+
+  void release_slot(Slot& slot) {
+    slot.m_busy = false;
+    slot.m_lastUsed = ++m_useClock;
+    m_slotFree.notify_all();
+  }
+
+  void set_abort_check(ActiveRequest* active) {
+    if (active == nullptr) {
+      llama_set_abort_callback(m_context.get(), nullptr, nullptr);
+      return;
+    }
+    llama_set_abort_callback(
+        m_context.get(),
+        [](void* data) { return interrupt_reason(*static_cast<const ActiveRequest*>(data)) != nullptr; }, active);
+  }
+
+  void finish(ActiveRequest& active) {
+    // Text still held back by the stop matcher belongs to the answer, unless
+    // the answer was cut shorter than that.
+    if (std::string rest = active.m_stop.flush(); !rest.empty() && active.m_cutTokens == 0) {
+      active.m_outbox.push_back(std::move(rest));
+    }
+    active.m_done = true;
+    m_active.erase(std::remove(m_active.begin(), m_active.end(), &active), m_active.end());
+    release_slot(*active.m_slot);
+  }
+
+  std::unique_ptr<llama_sampler, SamplerDeleter> make_sampler() const {
+    std::unique_ptr<llama_sampler, SamplerDeleter> sampler(
+        llama_sampler_chain_init(llama_sampler_chain_default_params()));
+    if (!sampler) {
+      throw std::runtime_error("llama-inproc failed to initialize sampler chain");
+    }
+
+    const int topK = m_options.m_profile == "fast" ? 20 : (m_options.m_profile == "quality" ? 60 : 40);
+    const float topP = m_options.m_profile == "quality" ? 0.98f : 0.95f;
+    const float temp = m_options.m_profile == "fast" ? 0.6f : (m_options.m_profile == "quality" ? 0.8f : 0.7f);
+    llama_sampler_chain_add(sampler.get(), llama_sampler_init_top_k(topK));
+    llama_sampler_chain_add(sampler.get(), llama_sampler_init_top_p(topP, 1));
+    llama_sampler_chain_add(sampler.get(), llama_sampler_init_temp(temp));
+    llama_sampler_chain_add(sampler.get(), llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    return sampler;
+  }
+
+  // Records one sampled token for the request; returns false once generation
+  // has to stop, either before the token (end of generation) or after it
+  // (stop sequence, repetition loop, max_tokens). Text that may begin a stop sequence is held
+  // back by the matcher, so a fake "user:" turn never reaches the stream.
+  bool emit(ActiveRequest& active, llama_token token) {
+    const llama_vocab* vocab = llama_model_get_vocab(m_model.get());
+    if (token == LLAMA_TOKEN_NULL || llama_vocab_is_eog(vocab, token)) {
+      return false;
+    }
+    active.m_tokenOffsets.push_back(active.m_output.size());
+    active.m_generatedIds.push_back(token);
+
+    const std::string piece = token_to_text(vocab, token);
+    if (!piece.empty()) {
+      if (!active.m_firstTokenRecorded) {
+        active.m_firstTokenRecorded = true;
+        const auto now = std::chrono::steady_clock::now();
+        active.m_firstTokenMs =
+            std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(now - active.m_tStart).count();
+      }
+      active.m_output += piece;
+      if (std::string visible = active.m_stop.feed(piece); !visible.empty() && active.m_streaming) {
+        active.m_outbox.push_back(std::move(visible));
+      }
+      if (active.m_stop.matched()) {
+        cut_at_stop_sequence(active);
+        return false;
+      }
+    }
+    if (active.m_repetition.push(token)) {
+      cut_repetition(active);
+      return false;
+    }
+    if (active.m_generatedIds.size() >= active.m_request->m_maxTokens) {
+      active.m_stopReason = "max_tokens";
+      return false;
+    }
+    return true;
+  }
+
+  // Trims the answer to the text before the matched stop sequence. Tokens
+  // that lie entirely inside the match are dropped from the ids and from the
+  // slot's KV, so the next turn's prompt still extends the cache. A token
+  // straddling the match start keeps only part of its text, so its id no
+  // longer detokenizes to the answer: the answer then carries no ids and is
+  // re-tokenized from its text on the next turn.
+  void cut_at_stop_sequence(ActiveRequest& active) {
+    const std::size_t end = active.m_stop.match_offset();
+    std::size_t keep = active.m_generatedIds.size();
+    while (keep > 0 && active.m_tokenOffsets[keep - 1] >= end) {
+      --keep;
+    }
+    if (keep > 0) {
+      const std::size_t tokenEnd = keep < active.m_tokenOffsets.size() ? active.m_tokenOffsets[keep]
+                                                                       : active.m_output.size();
+      active.m_idsMatchText = tokenEnd <= end;
+    }
+    cut_answer(active, keep, end);
+    active.m_stopReason = "stop_sequence";
+  }
+
+  // Keeps one copy of the repeating block and drops the rest, so the loop
+  // does not prime the next turn to repeat it again.
+  void cut_repetition(ActiveRequest& active) {
+    const std::size_t repeated = active.m_repetition.period() * (active.m_repetition.copies() - 1);
+    const std::size_t keep = active.m_generatedIds.size() - repeated;
+    active.m_repetitionSavedTokens = active.m_request->m_maxTokens - active.m_generatedIds.size();
+    cut_answer(active, keep, active.m_tokenOffsets[keep]);
+    active.m_stopReason = "repetition";
+  }
+
+  // Shortens the answer to its first `keep` tokens and `textEnd` bytes and
+  // drops the KV of the removed tokens, so the next turn's prompt still
+  // extends the slot's cache.
+  void cut_answer(ActiveRequest& active, std::size_t keep, std::size_t textEnd) {
+    active.m_cutTokens += active.m_generatedIds.size() - keep;
+    active.m_generatedIds.resize(keep);
+    active.m_tokenOffsets.resize(keep);
+    active.m_output.resize(textEnd);
+    Slot& slot = *active.m_slot;
+    truncate_cache(slot, std::min(slot.m_cached.size(), active.m_promptTokens + keep));
+  }
+
+  // One continuous-batching step. Every active request contributes its
+  // pending token and drafted continuation at the end of its own sequence;
+  // the main model is sampled at each of those positions, in order and with
+  // the request's sampler, so results match plain one-token decoding. Draft
+  // tokens the model agrees with are kept, KV for rejected ones is removed.
+  // Never throws: callers hold stack-allocated requests in m_active, so a
+  // failure is recorded on every request in the step and they are finished.
+  void run_step() {
+    try {
+      decode_step();
+    } catch (const std::exception& ex) {
+      llama_memory_t memory = llama_get_memory(m_context.get());
+      for (ActiveRequest* active : std::vector<ActiveRequest*>(m_active)) {
+        llama_memory_seq_rm(memory, active->m_slot->m_seqId, static_cast<llama_pos>(active->m_slot->m_cached.size()),
+                            -1);
+        active->m_error = std::string("llama-inproc decode step failed: ") + ex.what();
+        finish(*active);
+      }
+    }
+  }
+
+  void decode_step() {
+    // A cancelled request, or one out of time, leaves before the step: the
+    // token it already streamed stays in its answer but is never decoded, so
+    // the slot's cache still matches m_cached for the next turn.
+    for (ActiveRequest* active : std::vector<ActiveRequest*>(m_active)) {
+      if (const char* reason = interrupt_reason(*active); reason != nullptr) {
+        active->m_stopReason = reason;
+        active->m_cancelled = active->m_stopReason == "cancelled";
+        finish(*active);
+      }
+    }
+    if (m_active.empty()) {
+      return;
+    }
+    const std::vector<ActiveRequest*> stepping = m_active;
+    std::vector<std::vector<llama_token>> drafts(stepping.size());
+    std::size_t total = 0;
+    for (std::size_t r = 0; r < stepping.size(); ++r) {
+      ActiveRequest& active = *stepping[r];
+      const std::size_t room = active.m_request->m_maxTokens - active.m_generatedIds.size();
+      try {
+        drafts[r] = propose_draft(active,
+                                  std::min(room, static_cast<std::size_t>(std::max(0, m_options.m_draftMax))),
+                                  stepping.size() == 1);
+      } catch (const std::exception&) {
+        // A failed draft only costs the speedup; decode this step without one.
+        drafts[r].clear();
+      }
+      active.m_draftedTokens += drafts[r].size();
+      total += drafts[r].size() + 1;
+    }
+
+    std::unique_ptr<llama_batch, BatchDeleter> batch = make_batch(total);
+    std::vector<int32_t> firstIndex(stepping.size());
+    int32_t index = 0;
+    for (std::size_t r = 0; r < stepping.size(); ++r) {
+      const Slot& slot = *stepping[r]->m_slot;
+      firstIndex[r] = index;
+      const auto base = static_cast<llama_pos>(slot.m_cached.size());
+      for (std::size_t i = 0; i <= drafts[r].size(); ++i, ++index) {
+        batch->token[index] = i == 0 ? stepping[r]->m_pending : drafts[r][i - 1];
+        batch->pos[index] = base + static_cast<llama_pos>(i);
+        batch->n_seq_id[index] = 1;
+        batch->seq_id[index][0] = slot.m_seqId;
+        batch->logits[index] = 1;
+      }
+    }
+    batch->n_tokens = index;
+
+    llama_memory_t memory = llama_get_memory(m_context.get());
+    const int rc = llama_decode(m_context.get(), *batch);
+    if (rc != 0) {
+      // Drop whatever part of the batch made it into the cache and fail every
+      // request in it; their slots stay usable for the next turn.
+      for (ActiveRequest* active : stepping) {
+        llama_memory_seq_rm(memory, active->m_slot->m_seqId, static_cast<llama_pos>(active->m_slot->m_cached.size()),
+                            -1);
+        active->m_error = "llama-inproc token decode failed: code " + std::to_string(rc);
+        finish(*active);
+      }
+      return;
+    }
+
+    for (std::size_t r = 0; r < stepping.size(); ++r) {
+      ActiveRequest& active = *stepping[r];
+      Slot& slot = *active.m_slot;
+      const std::vector<llama_token>& draft = drafts[r];
+      slot.m_cached.push_back(active.m_pending);
+
+      std::vector<llama_token> sampled;
+      sampled.reserve(draft.size() + 1);
+      for (std::size_t i = 0; i <= draft.size(); ++i) {
+        const llama_token id =
+            llama_sampler_sample(active.m_sampler.get(), m_context.get(), firstIndex[r] + static_cast<int32_t>(i));
+        llama_sampler_accept(active.m_sampler.get(), id);
+        sampled.push_back(id);
+        if (i == draft.size() || id != draft[i]) {
+          break;
+        }
+        slot.m_cached.push_back(id);
+      }
+      if (sampled.size() < draft.size() + 1) {
+        llama_memory_seq_rm(memory, slot.m_seqId, static_cast<llama_pos>(slot.m_cached.size()), -1);
+      }
+      active.m_acceptedDraftTokens += sampled.size() - 1;
+
+      bool running = true;
+      for (std::size_t i = 0; running && i < sampled.size(); ++i) {
+        // The last sampled token becomes the next pending one; the others
+        // were decoded above and are emitted right away.
+        if (i + 1 == sampled.size()) {
+          active.m_pending = sampled[i];
+        }
+        running = emit(active, sampled[i]);
+      }
+      if (!running) {
+        finish(active);
+      }
+    }
+  }
+
+  // NUMA handling is process-wide in ggml, so the first runtime to
+  // initialize the backend decides it. A pinned node implies isolate: ggml
+  // then keeps its threads on the node the loading thread runs on.
+  void ensure_backend_init() const {
+    static std::once_flag once;
+    std::call_once(once, [this]() {
+      ggml_backend_load_all();
+      llama_backend_init();
+      llama_log_set(llama_silent_log_callback, nullptr);
+      ggml_numa_strategy strategy = GGML_NUMA_STRATEGY_DISABLED;
+      if (m_options.m_numa == "distribute") {
+        strategy = GGML_NUMA_STRATEGY_DISTRIBUTE;
+      } else if (m_options.m_numa == "isolate" || (m_options.m_numa.empty() && m_options.m_numaNode >= 0)) {
+        strategy = GGML_NUMA_STRATEGY_ISOLATE;
+      } else if (m_options.m_numa == "numactl") {
+        strategy = GGML_NUMA_STRATEGY_NUMACTL;
+      }
+      if (strategy != GGML_NUMA_STRATEGY_DISABLED) {
+        ScopedAffinity pinned(m_pinnedCpus);
+        llama_numa_init(strategy);
+      }
+    });
+  }
+
+  static std::unique_ptr<llama_model, ModelDeleter> load_model_file(const std::string& modelPath,
+                                                                    LoadProgress* progress = nullptr) {
+    llama_model_params modelParams = llama_model_default_params();
+    if (progress != nullptr) {
+      progress->m_fraction.store(0.0f);
+      modelParams.progress_callback = [](float value, void* userData) {
+        auto* state = static_cast<LoadProgress*>(userData);
+        state->m_fraction.store(value);
+        return !state->m_cancel.load();
+      };
+      modelParams.progress_callback_user_data = progress;
+    }
+    modelParams.use_mmap = true;
+    modelParams.use_mlock = false;
+    modelParams.n_gpu_layers = 0;
+    ggml_backend_dev_t cpuDevice = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    ggml_backend_dev_t devices[2] = {cpuDevice, nullptr};
+    if (cpuDevice != nullptr) {
+      modelParams.devices = devices;
+    }
+
+    std::unique_ptr<llama_model, ModelDeleter> model(llama_model_load_from_file(modelPath.c_str(), modelParams));
+    if (!model) {
+      throw std::runtime_error("llama-inproc failed to load model file: " + modelPath);
+    }
+    return model;
+  }
+
+  // Makes modelPath the current model: a resident copy is swapped back in,
+  // anything else is loaded synchronously.
+  void ensure_model_loaded(const std::string& modelPath) {
+    if (m_model && m_loadedModelPath == modelPath) {
+      return;
+    }
+    if (const auto it = find_resident(modelPath); it != m_resident.end()) {
+      std::unique_ptr<LoadedModel> resident = std::move(*it);
+      m_resident.erase(it);
+      install(std::move(*resident));
+      return;
+    }
+
+    const auto progress = std::make_shared<LoadProgress>();
+    begin_load(progress);
+    install(load_bundle(modelPath, progress.get()));
+    preload_prefix_blobs();
+    set_load_state("ready");
+  }
+
+  // Loads a model file and creates its context and slots. Touches only the
+  // options and the status fields, so it runs without the lock while the
+  // current model serves.
+  LoadedModel load_bundle(const std::string& modelPath, LoadProgress* progress) {
+    LoadedModel bundle;
+    bundle.m_path = modelPath;
+    bundle.m_key = model_identity_key(modelPath);
+    {
+      ScopedAffinity pinned(m_pinnedCpus);
+      bundle.m_model = load_model_file(modelPath, progress);
+    }
+    bundle.m_shape = shape_of(bundle.m_model.get());
+    bundle.m_threads = resolve_threads(modelPath);
+    if (!progress->m_cancel.load()) {
+      std::lock_guard<std::mutex> lock(m_statusMutex);
+      m_planShape = bundle.m_shape;
+      m_planThreads = bundle.m_threads;
+      m_allocatedCtx = 0;
+    }
+    create_context(bundle);
+    return bundle;
+  }
+
+  // Allocates the bundle's context at the planned size and lays out its
+  // slots and prefix-cache sequences.
+  void create_context(LoadedModel& bundle) const {
+    const MemoryPlan plan = plan_memory(bundle.m_shape, bundle.m_threads);
+    bundle.m_context = std::unique_ptr<llama_context, ContextDeleter>(
+        llama_init_from_model(bundle.m_model.get(), context_params(plan.m_nCtx, bundle.m_threads)));
+    if (!bundle.m_context) {
+      throw std::runtime_error("llama-inproc failed to create context (n_ctx " + std::to_string(plan.m_nCtx) +
+                               ", KV " + format_mib(plan.m_kvBytes) + ")");
+    }
+    apply_thread_options(bundle.m_context.get(), bundle.m_threads);
+    bundle.m_decodePool = make_threadpool(bundle.m_threads.m_nThreads);
+    bundle.m_batchPool = make_threadpool(bundle.m_threads.m_nThreadsBatch);
+    if (bundle.m_decodePool && bundle.m_batchPool) {
+      llama_attach_threadpool(bundle.m_context.get(), bundle.m_decodePool.get(), bundle.m_batchPool.get());
+    }
+    bundle.m_slots.clear();
+    bundle.m_freeCacheSeqs.clear();
+    bundle.m_prefixTree.clear();
+    bundle.m_spanTokens.clear();
+
+    const auto nSeq = static_cast<llama_seq_id>(llama_n_seq_max(bundle.m_context.get()));
+    const llama_seq_id nSlots = std::clamp<llama_seq_id>(m_options.m_nParallel, 1, nSeq);
+    bundle.m_slots.assign(static_cast<std::size_t>(nSlots), Slot{});
+    for (llama_seq_id i = 0; i < nSlots; ++i) {
+      bundle.m_slots[static_cast<std::size_t>(i)].m_seqId = i;
+    }
+    for (llama_seq_id seq = nSeq - 1; seq >= nSlots; --seq) {
+      bundle.m_freeCacheSeqs.push_back(seq);
+    }
+    // Cached prefixes may not crowd the slots out of a right-sized context.
+    bundle.m_prefixCacheBudgetTokens =
+        std::min<std::size_t>(static_cast<std::size_t>(std::max(0, m_options.m_prefixCacheMb)) * 1024 * 1024 /
+                                  std::max<std::size_t>(1, bundle.m_shape.m_kvBytesPerToken),
+                              llama_n_ctx(bundle.m_context.get()) / 4);
+    const std::uintmax_t kvBytes =
+        static_cast<std::uintmax_t>(bundle.m_shape.m_kvBytesPerToken) * llama_n_ctx(bundle.m_context.get());
+    bundle.m_bytes = model_file_bytes(bundle.m_path) + kvBytes;
+  }
+
+  // Makes bundle the current model. The outgoing one joins the resident
+  // models (most recently used first) and the least recently used are
+  // evicted until the budget holds; an evicted model parks its sessions in
+  // their KV snapshots before it is freed.
+  void install(LoadedModel bundle) {
+    swap_current(bundle);
+    reset_draft();
+    {
+      std::lock_guard<std::mutex> lock(m_statusMutex);
+      m_readyModelPath = m_loadedModelPath;
+    }
+    if (bundle.m_model) {
+      m_resident.insert(m_resident.begin(), std::make_unique<LoadedModel>(std::move(bundle)));
+    }
+    trim_resident();
+  }
+
+  // llama_resident_mb caps weights plus KV of every loaded model, current
+  // one included. Without it, keep_previous_model keeps a single previous
+  // model while its weights fit in currently available memory.
+  void trim_resident() {
+    const std::uintmax_t budget = static_cast<std::uintmax_t>(std::max(0, m_options.m_residentMb)) * 1024 * 1024;
+    std::uintmax_t used = m_loadedBytes;
+    for (const auto& resident : m_resident) {
+      used += resident->m_bytes;
+    }
+    while (!m_resident.empty()) {
+      const LoadedModel& oldest = *m_resident.back();
+      bool keep = false;
+      if (budget > 0) {
+        keep = used <= budget;
+      } else if (m_options.m_keepPreviousModel) {
+        keep = m_resident.size() == 1 && fits_in_free_memory(model_file_bytes(oldest.m_path));
+      }
+      if (keep) {
+        break;
+      }
+      used -= oldest.m_bytes;
+      for (auto& slot : m_resident.back()->m_slots) {
+        save_slot(oldest.m_context.get(), oldest.m_path, slot);
+      }
+      m_resident.pop_back();
+    }
+
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    m_residentPaths.clear();
+    for (const auto& resident : m_resident) {
+      m_residentPaths.push_back(resident->m_path);
+    }
+  }
+
+  std::vector<std::unique_ptr<LoadedModel>>::iterator find_resident(const std::string& modelPath) {
+    return std::find_if(m_resident.begin(), m_resident.end(),
+                        [&](const std::unique_ptr<LoadedModel>& resident) { return resident->m_path == modelPath; });
+  }
+
+  void swap_current(LoadedModel& other) {
+    std::swap(m_loadedModelPath, other.m_path);
+    std::swap(m_modelKey, other.m_key);
+    std::swap(m_decodePool, other.m_decodePool);
+    std::swap(m_batchPool, other.m_batchPool);
+    std::swap(m_model, other.m_model);
+    std::swap(m_context, other.m_context);
+    std::swap(m_slots, other.m_slots);
+    std::swap(m_prefixTree, other.m_prefixTree);
+    std::swap(m_freeCacheSeqs, other.m_freeCacheSeqs);
+    std::swap(m_prefixCacheBudgetTokens, other.m_prefixCacheBudgetTokens);
+    std::swap(m_spanTokens, other.m_spanTokens);
+    std::swap(m_loadedShape, other.m_shape);
+    std::swap(m_loadedThreads, other.m_threads);
+    std::swap(m_loadedBytes, other.m_bytes);
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    m_planShape = m_loadedShape;
+    m_planThreads = m_loadedThreads;
+    m_allocatedCtx = m_context ? llama_n_ctx(m_context.get()) : 0;
+  }
+
+  // Keeping a model resident only pays off if it does not push the machine
+  // into swap; require its weights to fit in currently available memory.
+  static bool fits_in_free_memory(std::uintmax_t bytes) {
+#if defined(_SC_AVPHYS_PAGES)
+    const long pages = sysconf(_SC_AVPHYS_PAGES);
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && pageSize > 0) {
+      return bytes < static_cast<std::uintmax_t>(pages) * static_cast<std::uintmax_t>(pageSize);
+    }
+#endif
+    (void)bytes;
+    return true;
+  }
+
+  void reset_draft() {
+    m_draftContext.reset();
+    m_draftModel.reset();
+    m_draftModelPath.clear();
+    m_draftTokens.clear();
+    m_draftWarning.clear();
+  }
+
+  // Loads the speculative draft model next to the main one. An empty path
+  // releases it; a draft whose vocabulary differs from the main model is
+  // dropped with a warning since its token ids would be meaningless.
+  void ensure_draft_loaded(const std::string& draftPath) {
+    if (draftPath == m_draftModelPath && (m_draftContext || !m_draftWarning.empty())) {
+      return;
+    }
+    reset_draft();
+    m_draftModelPath = draftPath;
+    if (draftPath.empty()) {
+      return;
+    }
+
+    std::unique_ptr<llama_model, ModelDeleter> draftModel = load_model_file(draftPath);
+    if (!vocabs_compatible(llama_model_get_vocab(m_model.get()), llama_model_get_vocab(draftModel.get()))) {
+      m_draftWarning = "draft model vocabulary differs from the active model; speculative decoding disabled";
+      return;
+    }
+
+    // The draft only ever holds one request, so one slot's share is enough.
+    llama_context_params ctxParams =
+        context_params(llama_n_ctx(m_context.get()) / static_cast<uint32_t>(m_slots.size()), m_loadedThreads);
+    ctxParams.n_seq_max = 1;
+    std::unique_ptr<llama_context, ContextDeleter> draftContext(llama_init_from_model(draftModel.get(), ctxParams));
+    if (!draftContext) {
+      throw std::runtime_error("llama-inproc failed to create draft context for: " + draftPath);
+    }
+    apply_thread_options(draftContext.get(), m_loadedThreads);
+    if (m_decodePool && m_batchPool) {
+      llama_attach_threadpool(draftContext.get(), m_decodePool.get(), m_batchPool.get());
+    }
+    m_draftModel = std::move(draftModel);
+    m_draftContext = std::move(draftContext);
+  }
+
+  llama_context_params context_params(uint32_t nCtx, const ThreadSettings& threads) const {
+    llama_context_params ctxParams = llama_context_default_params();
+    const uint32_t batch = static_cast<uint32_t>(threads.m_nBatch > 0 ? threads.m_nBatch : 512);
+    ctxParams.n_ctx = nCtx;
+    ctxParams.n_batch = batch;
+    ctxParams.n_ubatch =
+        m_options.m_nUbatch > 0 ? std::min(batch, static_cast<uint32_t>(m_options.m_nUbatch)) : batch;
+    // One sequence per parallel slot plus one per prefix-cache entry. The KV
+    // pool is unified so a single long conversation can still use the whole
+    // context, and sequences copied from a cached prefix share its cells.
+    ctxParams.n_seq_max =
+        static_cast<uint32_t>(std::max(1, m_options.m_nParallel) + std::max(0, m_options.m_prefixCacheEntries));
+    ctxParams.kv_unified = true;
+    ctxParams.offload_kqv = m_options.m_offloadKqv;
+    ctxParams.op_offload = m_options.m_opOffload;
+    ctxParams.type_k = kv_ggml_type();
+    ctxParams.type_v = kv_ggml_type();
+    ctxParams.flash_attn_type = m_options.m_flashAttn == "on"    ? LLAMA_FLASH_ATTN_TYPE_ENABLED
+                                : m_options.m_flashAttn == "off" ? LLAMA_FLASH_ATTN_TYPE_DISABLED
+                                                                 : LLAMA_FLASH_ATTN_TYPE_AUTO;
+    return ctxParams;
+  }
+
+  ggml_type kv_ggml_type() const {
+    if (m_options.m_kvCacheType == "q8_0") {
+      return GGML_TYPE_Q8_0;
+    }
+    if (m_options.m_kvCacheType == "q4_0") {
+      return GGML_TYPE_Q4_0;
+    }
+    return GGML_TYPE_F16;
+  }
+
+  static void apply_thread_options(llama_context* ctx, const ThreadSettings& threads) {
+    if (threads.m_nThreads > 0 || threads.m_nThreadsBatch > 0) {
+      const int nt = threads.m_nThreads > 0 ? threads.m_nThreads : llama_n_threads(ctx);
+      const int ntb = threads.m_nThreadsBatch > 0 ? threads.m_nThreadsBatch : llama_n_threads_batch(ctx);
+      llama_set_n_threads(ctx, nt, ntb);
+    }
+  }
+
+  // Settings from sentra.conf win; keys left at 0 take the values `sentra
+  // tune` measured for this model on this host, if any.
+  ThreadSettings resolve_threads(const std::string& modelPath) const {
+    ThreadSettings tuned;
+    if (!m_options.m_tuneDir.empty()) {
+      std::ifstream in(tune_file_path(modelPath));
+      std::string line;
+      while (std::getline(in, line)) {
+        const auto eq = line.find('=');
+        if (line.empty() || line[0] == '#' || eq == std::string::npos) {
+          continue;
+        }
+        const std::string key = line.substr(0, eq);
+        const int value = std::atoi(line.c_str() + eq + 1);
+        if (key == "llama_n_threads") {
+          tuned.m_nThreads = value;
+        } else if (key == "llama_n_threads_batch") {
+          tuned.m_nThreadsBatch = value;
+        } else if (key == "llama_n_batch") {
+          tuned.m_nBatch = value;
+        }
+      }
+    }
+    ThreadSettings threads{
+        .m_nThreads = m_options.m_nThreads > 0 ? m_options.m_nThreads : tuned.m_nThreads,
+        .m_nThreadsBatch = m_options.m_nThreadsBatch > 0 ? m_options.m_nThreadsBatch : tuned.m_nThreadsBatch,
+        .m_nBatch = m_options.m_nBatch > 0 ? m_options.m_nBatch : tuned.m_nBatch};
+    // Pinned pools get one thread per CPU in the set unless told fewer.
+    if (!m_pinnedCpus.empty()) {
+      const int nCpus = static_cast<int>(m_pinnedCpus.size());
+      threads.m_nThreads = threads.m_nThreads > 0 ? std::min(threads.m_nThreads, nCpus) : nCpus;
+      threads.m_nThreadsBatch = threads.m_nThreadsBatch > 0 ? std::min(threads.m_nThreadsBatch, nCpus) : nCpus;
+    }
+    return threads;
+  }
+
+  // A threadpool whose workers are bound to the pinned CPUs, or null when
+  // nothing is pinned (llama then manages its own threads). Decode and
+  // prefill get separate pools so each keeps its thread count warm.
+  ThreadpoolPtr make_threadpool(int nThreads) const {
+    if (m_pinnedCpus.empty() || nThreads <= 0) {
+      return ThreadpoolPtr(nullptr);
+    }
+    ggml_backend_dev_t cpuDevice = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (cpuDevice == nullptr) {
+      return ThreadpoolPtr(nullptr);
+    }
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(cpuDevice);
+    using NewFn = ggml_threadpool* (*)(ggml_threadpool_params*);
+    using FreeFn = void (*)(ggml_threadpool*);
+    auto newFn = reinterpret_cast<NewFn>(ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new"));
+    auto freeFn = reinterpret_cast<FreeFn>(ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free"));
+    if (newFn == nullptr || freeFn == nullptr) {
+      return ThreadpoolPtr(nullptr);
+    }
+    ggml_threadpool_params params = ggml_threadpool_params_default(nThreads);
+    std::fill(std::begin(params.cpumask), std::end(params.cpumask), false);
+    for (const int cpu : m_pinnedCpus) {
+      if (cpu >= 0 && cpu < GGML_MAX_N_THREADS) {
+        params.cpumask[cpu] = true;
+      }
+    }
+    params.strict_cpu = true;
+    return ThreadpoolPtr(newFn(&params), ThreadpoolDeleter{freeFn});
+  }
+
+  std::string tune_file_path(const std::string& modelPath) const {
+    std::error_code ec;
+    const std::string path = std::filesystem::absolute(modelPath, ec).string();
+    const std::string identity = path + "\n" + std::to_string(model_file_bytes(modelPath));
+    return (std::filesystem::path(m_options.m_tuneDir) /
+            (host_key() + "-" + to_hex(fnv1a(identity.data(), identity.size())) + ".conf"))
+        .string();
+  }
+
+  // Decodes the part of promptTokens past `cached` into sequence seq of ctx in
+  // chunks that never exceed n_batch. `cached` grows chunk by chunk so it
+  // always matches the KV cache, even if a later chunk fails or the context's
+  // abort callback stops it (prefill then returns early with `cached` short of
+  // the prompt); between_chunks runs after every chunk but the last. Returns
+  // the wall time in milliseconds.
+  static double prefill(llama_context* ctx, llama_seq_id seq, std::vector<llama_token>& cached,
+                        const std::vector<llama_token>& promptTokens, const PrefillProgressCallback& on_progress,
+                        const std::function<void()>& between_chunks = nullptr) {
+    const auto tStart = std::chrono::steady_clock::now();
+    const std::size_t start = cached.size();
+    const std::size_t total = promptTokens.size() - start;
+    const std::size_t chunk = pick_prefill_chunk(total, llama_n_batch(ctx), llama_n_ubatch(ctx));
+
+    std::unique_ptr<llama_batch, BatchDeleter> batch = make_batch(std::max<std::size_t>(1, chunk));
+    std::size_t done = 0;
+    double elapsedMs = 0.0;
+    while (done < total) {
+      const std::size_t n = std::min(chunk, total - done);
+      for (std::size_t i = 0; i < n; ++i) {
+        batch->token[i] = promptTokens[start + done + i];
+        batch->pos[i] = static_cast<llama_pos>(start + done + i);
+        batch->n_seq_id[i] = 1;
+        batch->seq_id[i][0] = seq;
+        batch->logits[i] = i + 1 == n ? 1 : 0;
+      }
+      batch->n_tokens = static_cast<int32_t>(n);
+      const int rc = llama_decode(ctx, *batch);
+      if (rc == 2) {
+        // Aborted through the abort callback. Ubatches that finished before
+        // the abort stay in memory, so trim them to keep `cached` exact.
+        llama_memory_seq_rm(llama_get_memory(ctx), seq, static_cast<llama_pos>(cached.size()), -1);
+        break;
+      }
+      if (rc != 0) {
+        throw std::runtime_error("llama-inproc prompt decode failed at token " + std::to_string(start + done) +
+                                 ": code " + std::to_string(rc));
+      }
+      cached.insert(cached.end(), promptTokens.begin() + static_cast<std::ptrdiff_t>(start + done),
+                    promptTokens.begin() + static_cast<std::ptrdiff_t>(start + done + n));
+      done += n;
+
+      const auto now = std::chrono::steady_clock::now();
+      elapsedMs = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(now - tStart).count();
+      if (on_progress) {
+        on_progress({.m_tokensDone = done,
+                     .m_tokensTotal = total,
+                     .m_tokensPerSecond = elapsedMs > 0.0 ? static_cast<double>(done) * 1000.0 / elapsedMs : 0.0});
+      }
+      if (done < total && between_chunks) {
+        between_chunks();
+      }
+    }
+    return elapsedMs;
+  }
+
+  // Prompt lookup is free, so it is tried first; the draft model only runs
+  // when no earlier n-gram matches the current tail. The draft context tracks
+  // a single sequence, so it is only used while one request is decoding.
+  std::vector<llama_token> propose_draft(const ActiveRequest& active, std::size_t nDraft, bool allowDraftModel) {
+    if (nDraft == 0) {
+      return {};
+    }
+    if (m_options.m_ngramDraft) {
+      std::vector<llama_token> draft = draft_with_ngram(active.m_slot->m_cached, active.m_pending, nDraft);
+      if (!draft.empty()) {
+        return draft;
+      }
+    }
+    if (m_draftContext && allowDraftModel) {
+      return draft_with_model(active.m_slot->m_cached, active.m_pending, nDraft);
+    }
+    return {};
+  }
+
+  // Prompt-lookup drafting: finds the most recent earlier occurrence of the
+  // last n tokens (longest n first) in the prompt and output so far and
+  // proposes the tokens that followed it. Edits and repeats of code already in
+  // the conversation are accepted in long runs at no extra model cost.
+  std::vector<llama_token> draft_with_ngram(const std::vector<llama_token>& cached, llama_token pending,
+                                            std::size_t nDraft) const {
+    const std::size_t length = cached.size() + 1;
+    const auto at = [&](std::size_t i) { return i < cached.size() ? cached[i] : pending; };
+
+    const std::size_t maxN = static_cast<std::size_t>(std::max(1, m_options.m_ngramMax));
+    const std::size_t minN = std::min(maxN, static_cast<std::size_t>(std::max(1, m_options.m_ngramMin)));
+    for (std::size_t n = maxN; n >= minN; --n) {
+      if (length <= n) {
+        continue;
+      }
+      const std::size_t keyStart = length - n;
+      for (std::size_t i = keyStart; i-- > 0;) {
+        std::size_t matched = 0;
+        while (matched < n && at(i + matched) == at(keyStart + matched)) {
+          ++matched;
+        }
+        if (matched < n) {
+          continue;
+        }
+        std::vector<llama_token> draft;
+        for (std::size_t j = i + n; j < length && draft.size() < nDraft; ++j) {
+          draft.push_back(at(j));
+        }
+        return draft;
+      }
+    }
+    return {};
+  }
+
+  // Greedily drafts up to nDraft tokens that continue the cached sequence plus
+  // `pending` with the draft model. Drafting stops early once the draft
+  // model's top choice falls below the configured probability floor, since
+  // unlikely guesses mostly cost a wider verify batch.
+  std::vector<llama_token> draft_with_model(const std::vector<llama_token>& cached, llama_token pending,
+                                            std::size_t nDraft) {
+    std::vector<llama_token> draft;
+    if (nDraft == 0) {
+      return draft;
+    }
+    // The draft context is one slot's share of n_ctx, but a single
+    // conversation may use the whole unified main cache.
+    if (cached.size() + 1 + nDraft > llama_n_ctx(m_draftContext.get())) {
+      return draft;
+    }
+    std::vector<llama_token> context = cached;
+    context.push_back(pending);
+    trim_sequence(m_draftContext.get(), 0, m_draftTokens,
+                  std::min(common_prefix(m_draftTokens, context), context.size() - 1));
+    prefill(m_draftContext.get(), 0, m_draftTokens, context, nullptr);
+
+    const int32_t nVocab = llama_vocab_n_tokens(llama_model_get_vocab(m_draftModel.get()));
+    while (draft.size() < nDraft) {
+      const float* logits = llama_get_logits_ith(m_draftContext.get(), -1);
+      if (logits == nullptr || nVocab <= 0) {
+        break;
+      }
+      int32_t best = 0;
+      for (int32_t i = 1; i < nVocab; ++i) {
+        if (logits[i] > logits[best]) {
+          best = i;
+        }
+      }
+      double denom = 0.0;
+      for (int32_t i = 0; i < nVocab; ++i) {
+        denom += std::exp(static_cast<double>(logits[i] - logits[best]));
+      }
+      if (1.0 / denom < m_options.m_draftPMin) {
+        break;
+      }
+      draft.push_back(best);
+      if (draft.size() == nDraft) {
+        break;
+      }
+      llama_token next = best;
+      if (llama_decode(m_draftContext.get(), llama_batch_get_one(&next, 1)) != 0) {
+        break;
+      }
+      m_draftTokens.push_back(next);
+    }
+    return draft;
+  }
+
+  static std::uintmax_t model_file_bytes(const std::string& modelPath) {
+    std::error_code ec;
+    const std::uintmax_t bytes = std::filesystem::file_size(modelPath, ec);
+    return ec ? 0 : bytes;
+  }
+
+  // Identifies the model file by absolute path, size and modification time,
+  // plus the KV cache type, so replacing a model in place or changing
+  // llama_kv_type invalidates its prefix blobs.
+  std::string model_identity_key(const std::string& modelPath) const {
+    std::error_code ec;
+    const std::string path = std::filesystem::absolute(modelPath, ec).string();
+    const auto mtime = std::filesystem::last_write_time(modelPath, ec).time_since_epoch().count();
+    const std::string identity = path + "\n" + std::to_string(model_file_bytes(modelPath)) + "\n" +
+                                 std::to_string(static_cast<long long>(mtime)) + "\n" + m_options.m_kvCacheType;
+    return to_hex(fnv1a(identity.data(), identity.size()));
+  }
+
+  // Drops tokens from position keep onward while leaving the KV for the prefix
+  // in place. Falls back to clearing the whole sequence when the memory cannot
+  // remove a tail (recurrent models) or no longer covers the start of the
+  // sequence (sliding-window caches).
+  static void trim_sequence(llama_context* ctx, llama_seq_id seq, std::vector<llama_token>& cached,
+                            std::size_t keep) {
+    if (keep >= cached.size()) {
+      return;
+    }
+    llama_memory_t memory = llama_get_memory(ctx);
+    if (keep == 0 || !llama_memory_seq_rm(memory, seq, static_cast<llama_pos>(keep), -1) ||
+        llama_memory_seq_pos_min(memory, seq) > 0) {
+      llama_memory_seq_rm(memory, seq, -1, -1);
+      keep = 0;
+    }
+    cached.resize(keep);
+  }
+
+  void truncate_cache(Slot& slot, std::size_t keep) {
+    if (keep < slot.m_cached.size()) {
+      trim_sequence(m_context.get(), slot.m_seqId, slot.m_cached, keep);
+      slot.m_snapshotDirty = true;
+    }
+  }
+
+  // When the context window prunes old turns, the new prompt is the cached
+  // sequence with a block removed right after the shared prefix (BOS and the
+  // pinned system messages, which act as attention sinks). Locate that block,
+  // remove its KV and shift the later positions down so the surviving turns
+  // stay cached. Returns the number of evicted tokens.
+  //
+  // Only spans past the pinned prefix are evicted: the shift moves positions
+  // of every sequence sharing a cell, and the pinned prefix is what prefix
+  // cache entries and /retry forks share with the slot.
+  std::size_t evict_dropped_span(Slot& slot, const std::vector<llama_token>& promptTokens,
+                                 std::size_t pinnedTokens) {
+    constexpr std::size_t kMinReusedRun = 32;
+    std::vector<llama_token>& cached = slot.m_cached;
+    const std::size_t keep = common_prefix(cached, promptTokens);
+    if (keep == 0 || keep < pinnedTokens || keep + 1 >= cached.size() || keep >= promptTokens.size()) {
+      return 0;
+    }
+    llama_memory_t memory = llama_get_memory(m_context.get());
+    if (!llama_memory_can_shift(memory)) {
+      return 0;
+    }
+
+    // The surviving turns are the end of the cache and continue at `keep` in
+    // the prompt, so the smallest gap is given by the longest suffix of the
+    // cache past `keep` that is a prefix of the prompt past `keep`. KMP finds
+    // it in one pass instead of comparing the tail once per candidate gap.
+    const std::size_t patternSize = std::min(promptTokens.size() - keep, cached.size() - keep - 1);
+    const auto pattern = [&](std::size_t i) { return promptTokens[keep + i]; };
+    std::vector<std::size_t> failure(patternSize, 0);
+    for (std::size_t i = 1, k = 0; i < patternSize; ++i) {
+      while (k > 0 && pattern(i) != pattern(k)) {
+        k = failure[k - 1];
+      }
+      if (pattern(i) == pattern(k)) {
+        ++k;
+      }
+      failure[i] = k;
+    }
+    std::size_t run = 0;
+    for (std::size_t i = keep + 1; i < cached.size(); ++i) {
+      if (run == patternSize) {
+        run = failure[run - 1];
+      }
+      while (run > 0 && cached[i] != pattern(run)) {
+        run = failure[run - 1];
+      }
+      if (cached[i] == pattern(run)) {
+        ++run;
+      }
+    }
+    if (run < kMinReusedRun) {
+      return 0;
+    }
+    const std::size_t gap = cached.size() - keep - run;
+
+    const auto p0 = static_cast<llama_pos>(keep);
+    const auto p1 = static_cast<llama_pos>(keep + gap);
+    if (!llama_memory_seq_rm(memory, slot.m_seqId, p0, p1)) {
+      return 0;
+    }
+    llama_memory_seq_add(memory, slot.m_seqId, p1, -1, -static_cast<llama_pos>(gap));
+    cached.erase(cached.begin() + static_cast<std::ptrdiff_t>(keep),
+                 cached.begin() + static_cast<std::ptrdiff_t>(keep + gap));
+    slot.m_snapshotDirty = true;
+    return gap;
+  }
+
+  // Loads the slot's session snapshot into its sequence if it was written for
+  // the same model file, replacing whatever the sequence held. generate()
+  // then trims it to the part that still prefixes the new prompt.
+  void restore_session_state(Slot& slot) {
+    std::error_code ec;
+    if (slot.m_sessionStatePath.empty() || !std::filesystem::exists(slot.m_sessionStatePath, ec)) {
+      return;
+    }
+
+    std::ifstream meta(slot.m_sessionStatePath + ".meta");
+    std::string line;
+    std::string modelPath;
+    std::string modelBytes;
+    std::string tokenCount;
+    while (std::getline(meta, line)) {
+      const auto eq = line.find('=');
+      if (eq == std::string::npos) {
+        continue;
+      }
+      const std::string key = line.substr(0, eq);
+      if (key == "model_path") {
+        modelPath = line.substr(eq + 1);
+      } else if (key == "model_bytes") {
+        modelBytes = line.substr(eq + 1);
+      } else if (key == "n_tokens") {
+        tokenCount = line.substr(eq + 1);
+      }
+    }
+    if (modelPath != m_loadedModelPath || modelBytes != std::to_string(model_file_bytes(m_loadedModelPath))) {
+      return;
+    }
+
+    llama_memory_t memory = llama_get_memory(m_context.get());
+    llama_memory_seq_rm(memory, slot.m_seqId, -1, -1);
+    slot.m_cached.clear();
+    slot.m_snapshotDirty = false;
+    std::vector<llama_token> tokens(llama_n_ctx(m_context.get()));
+    std::size_t count = 0;
+    const std::size_t read = llama_state_seq_load_file(m_context.get(), slot.m_sessionStatePath.c_str(), slot.m_seqId,
+                                                       tokens.data(), tokens.size(), &count);
+    if (read == 0 || tokenCount != std::to_string(count)) {
+      llama_memory_seq_rm(memory, slot.m_seqId, -1, -1);
+      return;
+    }
+    tokens.resize(count);
+    slot.m_cached = std::move(tokens);
+  }
+
+  // Builds the prompt as "role: content\n" spans followed by "assistant: ".
+  // Each span is tokenized on its own so a message always maps to the same ids
+  // regardless of what follows it; messages that carry ids for this model
+  // (earlier assistant turns) are spliced in verbatim. Together this keeps the
+  // prompt a strict extension of the cached tokens from turn to turn. With
+  // m_continueLast the prompt ends right after the last answer's ids, which
+  // is exactly what the slot decoded for it, so only decoding is left to do.
+  // pinnedTokens receives the length of BOS plus the leading system messages.
+  std::vector<llama_token> assemble_prompt(const llama_vocab* vocab, const GenerationRequest& request,
+                                          const std::vector<Message>& messages, std::size_t& pinnedTokens,
+                                          std::vector<std::size_t>& messageTokens) {
+    std::vector<llama_token> tokens;
+    messageTokens.assign(messages.size(), 0);
+    if (llama_vocab_get_add_bos(vocab)) {
+      tokens.push_back(llama_vocab_bos(vocab));
+    }
+    const auto append = [&tokens](const std::vector<llama_token>& span) {
+      tokens.insert(tokens.end(), span.begin(), span.end());
+    };
+    bool leadingSystem = true;
+    for (std::size_t i = 0; i < messages.size(); ++i) {
+      const Message& message = messages[i];
+      const std::size_t messageStart = tokens.size();
+      if (leadingSystem && message.m_role != Role::System) {
+        leadingSystem = false;
+        pinnedTokens = tokens.size();
+      }
+      const bool open = request.m_continueLast && i + 1 == messages.size();
+      const std::string header = role_to_string(message.m_role) + ": ";
+      if (!message.m_tokens.empty() && message.m_tokensModel == request.m_modelId) {
+        append(span_tokens(vocab, header));
+        tokens.insert(tokens.end(), message.m_tokens.begin(), message.m_tokens.end());
+        if (!open) {
+          append(span_tokens(vocab, "\n"));
+        }
+      } else if (open) {
+        append(span_tokens(vocab, header));
+        append(tokenize(vocab, message.m_content, false));
+      } else {
+        append(span_tokens(vocab, header + message.m_content + "\n"));
+      }
+      messageTokens[i] = tokens.size() - messageStart;
+    }
+    if (leadingSystem) {
+      pinnedTokens = tokens.size();
+    }
+    if (!request.m_continueLast) {
+      append(span_tokens(vocab, "assistant: "));
+    }
+    return tokens;
+  }
+
+  const std::vector<llama_token>& span_tokens(const llama_vocab* vocab, const std::string& text) {
+    if (const auto it = m_spanTokens.find(text); it != m_spanTokens.end()) {
+      return it->second;
+    }
+    if (m_spanTokens.size() >= 4096) {
+      m_spanTokens.clear();
+    }
+    return m_spanTokens.emplace(text, tokenize(vocab, text, false)).first->second;
+  }
+
+  static std::vector<llama_token> tokenize(const llama_vocab* vocab, const std::string& text, bool addSpecial) {
+    std::vector<llama_token> tokens(static_cast<std::size_t>(text.size()) + 16);
+    int32_t n = llama_tokenize(vocab, text.c_str(), static_cast<int32_t>(text.size()), tokens.data(),
+                               static_cast<int32_t>(tokens.size()), addSpecial, true);
+    if (n < 0) {
+      const int32_t required = -n;
+      tokens.assign(static_cast<std::size_t>(required), 0);
+      n = llama_tokenize(vocab, text.c_str(), static_cast<int32_t>(text.size()), tokens.data(), required, addSpecial,
+                         true);
+    }
+    if (n < 0) {
+      throw std::runtime_error("llama-inproc tokenization failed");
+    }
+    tokens.resize(static_cast<std::size_t>(n));
+    return tokens;
+  }
+
+  static std::string token_to_text(const llama_vocab* vocab, llama_token token) {
+    std::vector<char> buffer(32);
+    int32_t n = llama_token_to_piece(vocab, token, buffer.data(), static_cast<int32_t>(buffer.size()), 0, true);
+    if (n < 0) {
+      buffer.assign(static_cast<std::size_t>(-n), 0);
+      n = llama_token_to_piece(vocab, token, buffer.data(), static_cast<int32_t>(buffer.size()), 0, true);
+    }
+    if (n <= 0) {
+      return "";
+    }
+    return std::string(buffer.data(), static_cast<std::size_t>(n));
+  }
+
+  static std::size_t common_prefix(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+    const std::size_t n = std::min(a.size(), b.size());
+    std::size_t i = 0;
+    while (i < n && a[i] == b[i]) {
+      ++i;
+    }
+    return i;
   }
 
   std::mutex m_mutex;
+  std::condition_variable m_slotFree;
+  // Background loads started by preload(); only the newest one is not
+  // cancelled. The destructor waits for all of them.
+  std::vector<std::future<void>> m_loaders;
+  std::shared_ptr<LoadProgress> m_loaderProgress;
+  std::string m_stagingPath;
+  // Loaded models other than the current one, most recently used first.
+  std::vector<std::unique_ptr<LoadedModel>> m_resident;
+  std::uintmax_t m_loadedBytes{0};
+  ModelShape m_loadedShape;
+  ThreadSettings m_loadedThreads;
+  // Tokens one request may occupy (window plus reply), set by the orchestrator.
+  std::atomic<std::size_t> m_contextTokens{0};
+  mutable std::mutex m_statusMutex;
+  std::string m_loadState{"idle"};
+  std::string m_readyModelPath;
+  std::vector<std::string> m_residentPaths;
+  ModelShape m_planShape;
+  ThreadSettings m_planThreads;
+  uint32_t m_allocatedCtx{0};
+  // Progress of the most recent load, background or synchronous.
+  std::shared_ptr<LoadProgress> m_loadProgress;
   LlamaRuntimeOptions m_options;
+  std::vector<int> m_pinnedCpus;
+  ThreadpoolPtr m_decodePool{nullptr};
+  ThreadpoolPtr m_batchPool{nullptr};
   std::unique_ptr<llama_model, ModelDeleter> m_model{nullptr};
   std::unique_ptr<llama_context, ContextDeleter> m_context{nullptr};
   std::string m_loadedModelPath;
-  std::vector<llama_token> m_cachedPromptTokens;
+  std::vector<Slot> m_slots;
+  std::vector<ActiveRequest*> m_active;
+  std::uint64_t m_useClock{0};
+  std::size_t m_activeForks{0};
+  static constexpr std::size_t kMinCachedPrefix = 16;
+
+  PrefixTree m_prefixTree;
+  std::string m_modelKey;
+  std::vector<llama_seq_id> m_freeCacheSeqs;
+  std::size_t m_prefixCacheBudgetTokens{0};
+  std::unordered_map<std::string, std::vector<llama_token>> m_spanTokens;
+  std::unique_ptr<llama_model, ModelDeleter> m_draftModel{nullptr};
+  std::unique_ptr<llama_context, ContextDeleter> m_draftContext{nullptr};
+  std::string m_draftModelPath;
+  std::string m_draftWarning;
+  std::vector<llama_token> m_draftTokens;
 };
 
 #else
@@ -1,17 +1,27 @@
 #include "sentra/runtime.hpp"
 
+#include <algorithm>
 #include <chrono>
 #include <cerrno>
+#include <csignal>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
-#include <fstream>
 #include <memory>
 #include <sstream>
 #include <stdexcept>
-#include <time.h>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "sentra/stop_sequences.hpp"
+
+extern char** environ;
+
 namespace sentra {
 namespace {
 
@@ -32,10 +42,17 @@ std::string shell_escape_single_quoted(const std::string& value) {
 
 std::string render_prompt(const GenerationRequest& request) {
   std::ostringstream prompt;
-  for (const auto& message : request.m_messages) {
-    prompt << role_to_string(message.m_role) << ": " << message.m_content << "\n";
+  for (std::size_t i = 0; i < request.m_messages.size(); ++i) {
+    const Message& message = request.m_messages[i];
+    prompt << role_to_string(message.m_role) << ": " << message.m_content;
+    // An answer being continued is left open for the model to extend.
+    if (!request.m_continueLast || i + 1 < request.m_messages.size()) {
+      prompt << "\n";
+    }
+  }
+  if (!request.m_continueLast) {
+    prompt << "assistant: ";
   }
-  prompt << "assistant: ";
   return prompt.str();
 }
 
@@ -111,6 +128,111 @@ int command_exit_code(int status) {
   return status;
 }
 
+// A shell command whose stdout and stderr are read through a pipe. It runs
+// in its own process group so stop() reaches every process of the command;
+// Ctrl-C therefore only reaches it through the caller's cancel flag. If the
+// caller bails out early, the destructor kills and reaps it.
+class ChildProcess {
+ public:
+  explicit ChildProcess(const std::string& command) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      throw std::runtime_error("local-binary runtime failed to create pipe: " + std::string(std::strerror(errno)));
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+
+    std::string script = command;
+    char shell[] = "sh";
+    char flag[] = "-c";
+    char* argv[] = {shell, flag, script.data(), nullptr};
+    const int rc = posix_spawn(&m_pid, "/bin/sh", &actions, &attributes, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    close(fds[1]);
+    if (rc != 0) {
+      close(fds[0]);
+      throw std::runtime_error("local-binary runtime failed to start: " + std::string(std::strerror(rc)));
+    }
+    m_fd = fds[0];
+  }
+
+  ~ChildProcess() {
+    if (m_pid > 0) {
+      stop(SIGKILL);
+      wait();
+    }
+  }
+
+  ChildProcess(const ChildProcess&) = delete;
+  ChildProcess& operator=(const ChildProcess&) = delete;
+
+  int fd() const { return m_fd; }
+
+  void stop(int signal) {
+    if (m_pid > 0) {
+      kill(-m_pid, signal);
+      m_stopped = true;
+    }
+  }
+
+  // Closes the pipe and reaps the shell; returns its wait status. After
+  // stop(), the shell gets a short grace period to exit; then, or as soon as
+  // it has exited, the rest of its process group is killed, so a command that
+  // ignores the signal can neither hang cancel and the time budget nor keep
+  // running behind the shell.
+  int wait() {
+    if (m_fd >= 0) {
+      close(m_fd);
+      m_fd = -1;
+    }
+    int status = 0;
+    bool reaped = false;
+    if (m_stopped) {
+      const auto giveUp = std::chrono::steady_clock::now() + kStopGrace;
+      while (true) {
+        if (!reaped) {
+          const pid_t done = waitpid(m_pid, &status, WNOHANG);
+          if (done == m_pid || (done < 0 && errno != EINTR)) {
+            status = done < 0 ? -1 : status;
+            reaped = true;
+          }
+        }
+        if (reaped || std::chrono::steady_clock::now() >= giveUp) {
+          kill(-m_pid, SIGKILL);
+          break;
+        }
+        usleep(10000);
+      }
+    }
+    while (!reaped && waitpid(m_pid, &status, 0) < 0) {
+      if (errno != EINTR) {
+        status = -1;
+        break;
+      }
+    }
+    m_pid = -1;
+    return status;
+  }
+
+ private:
+  static constexpr std::chrono::milliseconds kStopGrace{500};
+
+  pid_t m_pid{-1};
+  int m_fd{-1};
+  bool m_stopped{false};
+};
+
 class LocalBinaryRuntime final : public IModelRuntime {
  public:
   explicit LocalBinaryRuntime(std::string commandTemplate)
@@ -159,26 +281,69 @@ GenerationResult generate(const GenerationRequest& request, StreamCallback on_to
     replace_all(command, "{model_path}", shell_escape_single_quoted(request.m_modelPath));
     replace_all(command, "{max_tokens}", std::to_string(request.m_maxTokens));
 
+    // The child's output is read as it arrives so it streams, and so a stop
+    // sequence, Ctrl-C or the time budget can end the turn early.
+    ChildProcess child(command);
+    StopSequenceMatcher stop(request.m_stopSequences);
     std::string output;
-
-    const std::filesystem::path outputPath =
-        std::filesystem::temp_directory_path() /
-        ("sentra-local-binary-" + std::to_string(static_cast<long long>(std::time(nullptr))) + ".log");
-    command += " > " + shell_escape_single_quoted(outputPath.string()) + " 2>&1";
-    const int exitCode = command_exit_code(std::system(command.c_str()));
-
-    {
-      std::ifstream in(outputPath);
-      std::ostringstream collected;
-      collected << in.rdbuf();
-      output = collected.str();
+    double firstTokenMs = 0.0;
+    bool cancelled = false;
+    bool budgetHit = false;
+    const auto deadline = request.m_maxLatencyMs > 0
+                              ? tStart + std::chrono::milliseconds(request.m_maxLatencyMs)
+                              : std::chrono::steady_clock::time_point::max();
+    std::vector<char> buffer(4096);
+    while (!stop.matched()) {
+      if (request.m_cancel != nullptr && request.m_cancel->load()) {
+        cancelled = true;
+        child.stop(SIGINT);
+        break;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      if (now >= deadline) {
+        budgetHit = true;
+        child.stop(SIGTERM);
+        break;
+      }
+      // Wake up periodically so a cancel flag set from another thread is seen.
+      const auto untilDeadline = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+      pollfd ready{child.fd(), POLLIN, 0};
+      const int polled = poll(&ready, 1, static_cast<int>(std::min<long long>(untilDeadline + 1, 100)));
+      if (polled < 0 && errno == EINTR) {
+        continue;
+      }
+      if (polled == 0) {
+        continue;
+      }
+      const ssize_t n = read(child.fd(), buffer.data(), buffer.size());
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      if (output.empty()) {
+        firstTokenMs = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(
+                           std::chrono::steady_clock::now() - tStart)
+                           .count();
+      }
+      const std::string chunk(buffer.data(), static_cast<std::size_t>(n));
+      output += chunk;
+      if (const std::string visible = stop.feed(chunk); !visible.empty()) {
+        on_token(visible);
+      }
     }
-    std::filesystem::remove(outputPath);
-
-    if (!output.empty()) {
-      on_token(output);
+    if (stop.matched()) {
+      child.stop(SIGTERM);
+      output.resize(stop.match_offset());
+    } else if (const std::string rest = stop.flush(); !rest.empty()) {
+      on_token(rest);
     }
-    if (exitCode != 0) {
+    const int exitCode = command_exit_code(child.wait());
+
+    // Exit codes only count when the command ended on its own.
+    const bool stoppedEarly = stop.matched() || cancelled || budgetHit;
+    if (exitCode != 0 && !stoppedEarly) {
       throw std::runtime_error("local-binary runtime failed with exit code " + std::to_string(exitCode) +
                                ": " + output);
     }
@@ -199,10 +364,13 @@ GenerationResult generate(const GenerationRequest& request, StreamCallback on_to
     return {.m_text = output,
             .m_contextTruncated = false,
             .m_warning = "",
-            .m_firstTokenMs = totalMs,
+            .m_firstTokenMs = firstTokenMs,
             .m_totalMs = totalMs,
             .m_generatedTokens = approxTokens,
-            .m_tokensPerSecond = tokensPerSecond};
+            .m_tokensPerSecond = tokensPerSecond,
+            .m_cancelled = cancelled,
+            .m_stopReason = stop.matched() ? "stop_sequence"
+                                           : (cancelled ? "cancelled" : (budgetHit ? "time_budget" : "eos"))};
   }
 
  private:
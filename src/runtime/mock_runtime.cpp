@@ -24,12 +24,22 @@ class MockRuntime final : public IModelRuntime {
     }
 
     std::ostringstream response;
-    response << "[MOCK] Sentra received: " << lastUser
-             << " | This is a local-first scaffold. Connect a real runtime via config.";
+    if (request.m_continueLast) {
+      response << " [MOCK] continued.";
+    } else {
+      response << "[MOCK] Sentra received: " << lastUser
+               << " | This is a local-first scaffold. Connect a real runtime via config.";
+    }
 
-    const std::string text = response.str();
-    for (char c : text) {
-      on_token(std::string(1, c));
+    std::string text = response.str();
+    bool cancelled = false;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+      if (request.m_cancel != nullptr && request.m_cancel->load()) {
+        text.resize(i);
+        cancelled = true;
+        break;
+      }
+      on_token(std::string(1, text[i]));
     }
     const auto tEnd = std::chrono::steady_clock::now();
     const double totalMs =
@@ -40,7 +50,9 @@ class MockRuntime final : public IModelRuntime {
             .m_firstTokenMs = 0.0,
             .m_totalMs = totalMs,
             .m_generatedTokens = text.empty() ? static_cast<std::size_t>(0) : static_cast<std::size_t>(1),
-            .m_tokensPerSecond = totalMs > 0.0 ? (1000.0 / totalMs) : 0.0};
+            .m_tokensPerSecond = totalMs > 0.0 ? (1000.0 / totalMs) : 0.0,
+            .m_cancelled = cancelled,
+            .m_stopReason = cancelled ? "cancelled" : "eos"};
   }
 };
 
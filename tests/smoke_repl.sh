@@ -44,4 +44,20 @@ grep -q "active model: alt_model" "${OUTPUT_FILE}"
 grep -q "session_id:" "${OUTPUT_FILE}"
 grep -q "runtime_name: mock" "${OUTPUT_FILE}"
 
+# The REPL run above switched to a model with no file; give the daemon its own state.
+sed "s|^state_file=.*|state_file=${TMP_DIR}/daemon-state.conf|" "${TMP_DIR}/sentra.conf" > "${TMP_DIR}/daemon.conf"
+SOCKET_PATH="${TMP_DIR}/sentra.sock"
+"${BIN_PATH}" --config "${TMP_DIR}/daemon.conf" --socket "${SOCKET_PATH}" --daemon > "${TMP_DIR}/daemon.out" 2>&1 &
+DAEMON_PID=$!
+for _ in $(seq 1 50); do
+  [ -S "${SOCKET_PATH}" ] && break
+  sleep 0.1
+done
+"${BIN_PATH}" --config "${TMP_DIR}/daemon.conf" --socket "${SOCKET_PATH}" --client "daemon ping" > "${TMP_DIR}/client.out" 2>&1
+"${BIN_PATH}" --config "${TMP_DIR}/daemon.conf" --socket "${SOCKET_PATH}" --daemon-stop > /dev/null
+wait "${DAEMON_PID}"
+
+grep -q "Sentra received: daemon ping" "${TMP_DIR}/client.out"
+grep -q "sentra daemon stopped" "${TMP_DIR}/daemon.out"
+
 echo "smoke_repl: passed"
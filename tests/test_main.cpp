@@ -6,9 +6,14 @@
 #include <vector>
 #include <cstdlib>
 
+#include "sentra/config.hpp"
 #include "sentra/context_window.hpp"
+#include "sentra/daemon.hpp"
 #include "sentra/model_registry.hpp"
+#include "sentra/prefix_tree.hpp"
+#include "sentra/repetition_detector.hpp"
 #include "sentra/session_store.hpp"
+#include "sentra/stop_sequences.hpp"
 #include "sentra/types.hpp"
 
 namespace fs = std::filesystem;
@@ -80,6 +85,116 @@ void test_session_store_encoding_and_metadata() {
   fs::remove_all(dir);
 }
 
+void test_session_store_message_tokens() {
+  const std::string dir = make_temp_dir("sentra-tokens-");
+  sentra::SessionStore store(dir);
+  const std::string sessionId = "session-tokens";
+
+  store.append(sessionId, {sentra::Role::User, "hello"});
+  store.append(sessionId, {sentra::Role::Assistant, "hi there", {1, 22, 333}, "models\\x\ty"});
+  {
+    std::ofstream legacy(dir + "/" + sessionId + ".log", std::ios::app);
+    legacy << "v1\tmsg\tuser\tlegacy line\n";
+  }
+
+  const std::vector<sentra::Message> loaded = store.load(sessionId);
+  assert_true(loaded.size() == 3, "three messages should load");
+  assert_true(loaded[0].m_tokens.empty(), "messages without tokens should load without tokens");
+  assert_true(loaded[1].m_tokens == std::vector<std::int32_t>({1, 22, 333}), "assistant tokens should round-trip");
+  assert_true(loaded[1].m_tokensModel == "models\\x\ty", "escaped token model ids should round-trip");
+  assert_true(loaded[2].m_content == "legacy line", "four-column lines should still load");
+  assert_true(loaded[2].m_tokens.empty(), "four-column lines should load without tokens");
+
+  fs::remove_all(dir);
+}
+
+void test_session_store_kv_snapshot_sidecar() {
+  const std::string dir = make_temp_dir("sentra-kv-");
+  sentra::SessionStore store(dir);
+  const std::string sessionId = "session-kv";
+
+  store.ensure_session(sessionId, "model-x", "mock");
+  store.append(sessionId, {sentra::Role::User, "hello"});
+  std::ofstream(store.kv_snapshot_path_for(sessionId)) << "kv";
+
+  const auto listed = store.list_sessions();
+  assert_true(listed.size() == 1, "kv snapshot sidecars should not be listed as sessions");
+  assert_true(fs::path(store.kv_snapshot_path_for(sessionId)).parent_path() == fs::path(dir),
+              "kv snapshot should live next to the session log");
+
+  fs::remove_all(dir);
+}
+
+void test_session_store_continuation() {
+  const std::string dir = make_temp_dir("sentra-cont-");
+  sentra::SessionStore store(dir);
+  const std::string sessionId = "session-cont";
+
+  store.append(sessionId, {sentra::Role::User, "hello"});
+  store.append(sessionId, {sentra::Role::Assistant, "hi there", {1, 22, 333}, "model-x"});
+  store.append_continuation(sessionId, {sentra::Role::Assistant, " friend", {44}, "model-x"});
+
+  std::vector<sentra::Message> loaded = store.load(sessionId);
+  assert_true(loaded.size() == 2, "a continuation should not add a message");
+  assert_true(loaded[1].m_content == "hi there friend", "continuation should extend the last message");
+  assert_true(loaded[1].m_tokens == std::vector<std::int32_t>({1, 22, 333, 44}),
+              "continuation tokens should extend the last message");
+
+  store.append_continuation(sessionId, {sentra::Role::Assistant, "!", {9}, "model-y"});
+  loaded = store.load(sessionId);
+  assert_true(loaded[1].m_content == "hi there friend!", "a continuation from another model should extend the text");
+  assert_true(loaded[1].m_tokens.empty() && loaded[1].m_tokensModel.empty(),
+              "mixed-model tokens should be dropped");
+
+  fs::remove_all(dir);
+}
+
+void test_session_store_retry() {
+  const std::string dir = make_temp_dir("sentra-redo-");
+  sentra::SessionStore store(dir);
+  const std::string sessionId = "session-redo";
+
+  store.append(sessionId, {sentra::Role::User, "hello"});
+  store.append(sessionId, {sentra::Role::Assistant, "first try", {3}, "model-x"});
+  store.replace_last(sessionId, {sentra::Role::Assistant, "second try", {7}, "model-x"});
+
+  const std::vector<sentra::Message> loaded = store.load(sessionId);
+  assert_true(loaded.size() == 2, "a retried answer should not add a message");
+  assert_true(loaded[1].m_content == "second try", "a retried answer should replace the last message");
+  assert_true(loaded[1].m_tokens == std::vector<std::int32_t>({7}), "a retried answer should keep its tokens");
+
+  fs::remove_all(dir);
+}
+
+void test_session_store_cancelled_answer() {
+  const std::string dir = make_temp_dir("sentra-cancelled-");
+  sentra::SessionStore store(dir);
+  const std::string sessionId = "session-cancelled";
+
+  std::vector<sentra::Message> history{{sentra::Role::User, "hello"}};
+  store.append(sessionId, history.back());
+
+  sentra::GenerationResult cancelled;
+  cancelled.m_stopReason = "cancelled";
+  cancelled.m_cancelled = true;
+  assert_true(!sentra::record_answer(store, sessionId, history, cancelled),
+              "an answer cancelled before its first token should not be recorded");
+  assert_true(history.size() == 1, "history should keep only the pending user turn");
+  assert_true(store.load(sessionId).size() == history.size(), "the log should match the history");
+
+  sentra::GenerationResult answered;
+  answered.m_text = "hi";
+  answered.m_tokens = {5};
+  answered.m_tokensModel = "model-x";
+  assert_true(sentra::record_answer(store, sessionId, history, answered), "an answer with text should be recorded");
+  const std::vector<sentra::Message> loaded = store.load(sessionId);
+  assert_true(history.size() == 2 && loaded.size() == 2, "the answer should reach the history and the log");
+  assert_true(loaded[1].m_content == "hi" && loaded[1].m_tokens == history[1].m_tokens,
+              "the logged answer should match the history");
+
+  fs::remove_all(dir);
+}
+
 void test_context_pruning() {
   std::vector<sentra::Message> history = {
       {sentra::Role::System, "You are system prompt and should stay."},
@@ -97,13 +212,181 @@ void test_context_pruning() {
   assert_true(pruned.m_truncated, "history should be marked truncated when budget is tight");
 }
 
+void test_context_pruning_hysteresis() {
+  std::vector<sentra::Message> history = {
+      {sentra::Role::System, "sys prompt"},
+      {sentra::Role::User, "one two three four"},
+      {sentra::Role::Assistant, "one two three four"},
+      {sentra::Role::User, "one two three four"},
+      {sentra::Role::Assistant, "one two three four"},
+      {sentra::Role::User, "one two"},
+  };
+
+  // 2 system + 18 non-system tokens exceed 16, so the cut jumps to the 10-token low-water mark.
+  const sentra::ContextPruneResult first = sentra::prune_context_window_stable(history, 16, 10, 0);
+  assert_true(first.m_truncated, "over-budget history should be truncated");
+  assert_true(first.m_firstKeptIndex == 4, "cut should advance until the low-water mark fits");
+  assert_true(first.m_tokensKept == 8, "kept tokens should include system and tail");
+  assert_true(first.m_messages.size() == 3, "system plus two newest messages should remain");
+  assert_true(first.m_messages.front().m_role == sentra::Role::System, "system message should remain pinned");
+
+  history.push_back({sentra::Role::Assistant, "one two"});
+  history.push_back({sentra::Role::User, "one two"});
+  const sentra::ContextPruneResult second =
+      sentra::prune_context_window_stable(history, 16, 10, first.m_firstKeptIndex);
+  assert_true(second.m_firstKeptIndex == first.m_firstKeptIndex, "cut should stay frozen while under budget");
+  assert_true(second.m_messages.size() == 5, "new messages should extend the frozen prefix");
+  assert_true(second.m_messages[1].m_content == first.m_messages[1].m_content,
+              "prompt prefix should be unchanged between turns");
+}
+
+void test_context_pruning_real_tokens() {
+  const std::vector<sentra::Message> history = {
+      {sentra::Role::System, "sys prompt"},
+      {sentra::Role::User, "std::vector<std::pair<int,int>> v;"},
+      {sentra::Role::Assistant, "v.emplace_back(1,2);"},
+      {sentra::Role::User, "and now?"},
+  };
+  // Six words fit a 10-token window by estimate, but the code tokenizes to far more.
+  const sentra::ContextPruneResult estimated = sentra::prune_context_window(history, 10);
+  assert_true(!estimated.m_truncated, "word estimate should think the history fits");
+
+  const std::vector<std::size_t> realTokens = {3, 14, 9, 4};
+  const sentra::ContextPruneResult fitted = sentra::prune_to_token_counts(estimated.m_messages, realTokens, 10);
+  assert_true(fitted.m_truncated, "real token counts should force a trim");
+  assert_true(fitted.m_tokensKept == 7, "system prompt and last message should remain");
+  assert_true(fitted.m_messages.size() == 2, "oldest non-system messages should be dropped");
+  assert_true(fitted.m_messages.front().m_role == sentra::Role::System, "system message should remain pinned");
+  assert_true(fitted.m_messages.back().m_content == "and now?", "latest message should be kept");
+
+  const sentra::ContextPruneResult roomy = sentra::prune_to_token_counts(estimated.m_messages, realTokens, 64);
+  assert_true(!roomy.m_truncated && roomy.m_messages.size() == 4, "history within budget should be kept whole");
+}
+
+void test_prefix_tree() {
+  sentra::PrefixTree tree;
+  tree.insert({1, 2, 3, 4, 5}, 10);
+  tree.insert({1, 2, 3, 9}, 11);
+  assert_true(tree.entry_count() == 2, "both entries should be stored");
+  assert_true(tree.token_count() == 6, "shared prefix should be stored once");
+
+  const auto match = tree.longest_match({1, 2, 3, 4, 7, 8});
+  assert_true(match.m_entry == 10 && match.m_length == 4, "longest match should end at the divergence");
+  const auto partial = tree.longest_match({1, 2, 6});
+  assert_true(partial.m_length == 2 && partial.m_entry == 10, "mid-edge match should pick the most recent entry");
+  assert_true(tree.longest_match({7}).m_entry == -1, "unrelated tokens should not match");
+
+  assert_true(tree.least_recent_entry() == 11, "untouched entry should be least recent");
+  tree.erase(11);
+  assert_true(tree.token_count() == 5, "erasing an entry should free its private tokens");
+  assert_true(tree.longest_match({1, 2, 3, 9}).m_length == 3, "remaining entry should still match");
+  assert_true(tree.insert({1, 2, 3, 4, 5}, 12) == 10, "same path should replace the old entry");
+  tree.erase(12);
+  assert_true(tree.entry_count() == 0 && tree.token_count() == 0, "tree should be empty");
+}
+
+void test_daemon_frame_round_trip() {
+  const std::vector<std::string> fields{"token", "line one\n\tindented \\ path", ""};
+  const std::string encoded = sentra::encode_frame(fields);
+  assert_true(encoded.find('\n') == encoded.size() - 1, "frame should be a single line");
+  const std::vector<std::string> decoded = sentra::decode_frame(encoded.substr(0, encoded.size() - 1));
+  assert_true(decoded == fields, "frame fields should round-trip");
+  assert_true(sentra::decode_frame("ping") == std::vector<std::string>{"ping"}, "bare command should decode");
+
+  assert_true(sentra::is_valid_session_id("session-1700000000-2"), "generated session ids should be valid");
+  assert_true(sentra::is_valid_session_id("my_chat"), "underscores should be allowed in session ids");
+  assert_true(!sentra::is_valid_session_id(""), "empty session ids should be rejected");
+  assert_true(!sentra::is_valid_session_id("../etc"), "parent references should be rejected");
+  assert_true(!sentra::is_valid_session_id("a/b"), "path separators should be rejected");
+  assert_true(!sentra::is_valid_session_id(std::string("a\0b", 3)), "NUL should be rejected");
+  assert_true(!sentra::is_valid_session_id("a.log"), "dots should be rejected");
+}
+
+void test_stop_sequence_matcher() {
+  sentra::StopSequenceMatcher matcher(sentra::transcript_stop_sequences());
+  std::string streamed = matcher.feed("The answer is 4.");
+  streamed += matcher.feed("\n");
+  assert_true(streamed == "The answer is 4.", "possible stop prefix should be held back");
+  streamed += matcher.feed("us");
+  streamed += matcher.feed("er: and now");
+  assert_true(matcher.matched() && matcher.match_offset() == 16, "split stop sequence should match");
+  assert_true(streamed == "The answer is 4.", "nothing past the match should stream");
+  assert_true(matcher.feed("more").empty() && matcher.flush().empty(), "matcher should stay stopped");
+
+  sentra::StopSequenceMatcher plain(sentra::transcript_stop_sequences());
+  std::string text = plain.feed("line one\n");
+  text += plain.feed("users agree");
+  text += plain.flush();
+  assert_true(!plain.matched() && text == "line one\nusers agree", "near miss should be released intact");
+
+  const auto parsed = sentra::parse_stop_sequences("\\nQ:|END\\|X||");
+  assert_true(parsed == std::vector<std::string>{"\nQ:", "END|X"}, "config value should unescape");
+}
+
+void test_repetition_detector() {
+  sentra::RepetitionDetector detector(16, 4, 32);
+  bool looping = false;
+  for (std::int32_t i = 0; i < 40 && !looping; ++i) {
+    looping = detector.push(i);
+  }
+  assert_true(!looping, "distinct tokens should not look like a loop");
+  const std::vector<std::int32_t> line{7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+  std::size_t pushed = 0;
+  while (!looping && pushed < 100) {
+    looping = detector.push(line[pushed++ % line.size()]);
+  }
+  assert_true(looping && pushed == 40, "four copies of a 10-token line should be a loop");
+  assert_true(detector.period() == 10 && detector.copies() == 4, "loop block should be reported");
+
+  sentra::RepetitionDetector dashes(16, 4, 32);
+  for (int i = 0; i < 31; ++i) {
+    assert_true(!dashes.push(42), "short runs of one token should be allowed");
+  }
+  assert_true(dashes.push(42), "a long run of one token should be a loop");
+  assert_true(!sentra::RepetitionDetector().push(1), "disabled detector should never fire");
+}
+
+void test_repetition_detector_defaults() {
+  const sentra::AppConfig config;
+  // Pushes a loop of `period` distinct tokens after some unique text and
+  // returns how many loop tokens it took to fire (0 = never within max_tokens).
+  const auto tokens_to_fire = [&config](std::int32_t period) -> std::size_t {
+    sentra::RepetitionDetector detector(config.m_repeatWindow, config.m_repeatThreshold, config.m_repeatMinTokens);
+    for (std::int32_t i = 0; i < 20; ++i) {
+      detector.push(1000 + i);
+    }
+    for (std::size_t pushed = 1; pushed + 20 <= config.m_maxTokens; ++pushed) {
+      if (detector.push(static_cast<std::int32_t>((pushed - 1) % static_cast<std::size_t>(period)))) {
+        return pushed;
+      }
+    }
+    return 0;
+  };
+  const std::size_t shortLoop = tokens_to_fire(2);
+  assert_true(shortLoop > 0 && shortLoop <= config.m_repeatMinTokens, "a 2-token loop should be caught by default");
+  const std::size_t longLoop = tokens_to_fire(100);
+  assert_true(longLoop > 0 && longLoop <= 200, "a 100-token loop should be caught by default");
+}
+
 }  // namespace
 
 int main() {
   try {
     test_model_registry_parsing_and_switching();
     test_session_store_encoding_and_metadata();
+    test_session_store_message_tokens();
+    test_session_store_kv_snapshot_sidecar();
+    test_session_store_continuation();
+    test_session_store_retry();
+    test_session_store_cancelled_answer();
     test_context_pruning();
+    test_context_pruning_hysteresis();
+    test_context_pruning_real_tokens();
+    test_prefix_tree();
+    test_daemon_frame_round_trip();
+    test_stop_sequence_matcher();
+    test_repetition_detector();
+    test_repetition_detector_defaults();
     std::cout << "sentra_tests: all tests passed\n";
     return 0;
   } catch (const std::exception& ex) {